@@ -2,8 +2,12 @@
 
 #include <pthread.h>
 
+#define AI_TTL 300      // Seconds a resolved name is remembered.
+#define AI_NEG_TTL 30   // Seconds a failed lookup is remembered.
+
 struct ai_ctx {
     BTPDQ_ENTRY(ai_ctx) entry;
+    struct ai_entry *ae;
     struct addrinfo hints;
     struct addrinfo *res;
     char node[255], service[6];
@@ -16,14 +20,116 @@ struct ai_ctx {
 
 BTPDQ_HEAD(ai_ctx_tq, ai_ctx);
 
+/*
+ * A remembered lookup. getaddrinfo doesn't tell the TTL of the records
+ * it found, so they're kept for a fixed time. Lookups of a name that's
+ * being resolved wait for the result instead of resolving it again.
+ */
+struct ai_entry {
+    BTPDQ_ENTRY(ai_entry) entry;
+    struct ai_ctx_tq waiting;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char node[255], service[6];
+    int error;
+    int resolving;
+    long expires;
+};
+
+BTPDQ_HEAD(ai_entry_tq, ai_entry);
+
 static struct ai_ctx_tq m_aiq = BTPDQ_HEAD_INITIALIZER(m_aiq);
 static pthread_mutex_t m_aiq_lock;
 static pthread_cond_t m_aiq_cond;
 
+static struct ai_entry_tq m_cache = BTPDQ_HEAD_INITIALIZER(m_cache);
+
+/*
+ * Copy an addrinfo list into one that btpd_addrinfo_free can free.
+ */
+static struct addrinfo *
+ai_dup(const struct addrinfo *ai)
+{
+    struct addrinfo *res = NULL, **tail = &res;
+    for (; ai != NULL; ai = ai->ai_next) {
+        struct addrinfo *cp = btpd_malloc(sizeof(*cp) + ai->ai_addrlen);
+        *cp = *ai;
+        cp->ai_addr = (struct sockaddr *)(cp + 1);
+        bcopy(ai->ai_addr, cp->ai_addr, ai->ai_addrlen);
+        cp->ai_canonname = NULL;
+        cp->ai_next = NULL;
+        *tail = cp;
+        tail = &cp->ai_next;
+    }
+    return res;
+}
+
+void
+btpd_addrinfo_free(struct addrinfo *ai)
+{
+    struct addrinfo *next;
+    for (; ai != NULL; ai = next) {
+        next = ai->ai_next;
+        free(ai);
+    }
+}
+
+static int
+ai_match(struct ai_entry *ae, struct ai_ctx *ctx)
+{
+    return strcmp(ae->node, ctx->node) == 0
+        && strcmp(ae->service, ctx->service) == 0
+        && ae->hints.ai_flags == ctx->hints.ai_flags
+        && ae->hints.ai_family == ctx->hints.ai_family
+        && ae->hints.ai_socktype == ctx->hints.ai_socktype
+        && ae->hints.ai_protocol == ctx->hints.ai_protocol;
+}
+
+/*
+ * Find the lookup matching the context, forgetting the expired ones on
+ * the way.
+ */
+static struct ai_entry *
+ai_lookup(struct ai_ctx *ctx)
+{
+    struct ai_entry *ae, *next;
+    BTPDQ_FOREACH_MUTABLE(ae, &m_cache, entry, next) {
+        if (!ae->resolving && ae->expires <= btpd_seconds) {
+            BTPDQ_REMOVE(&m_cache, ae, entry);
+            if (ae->res != NULL)
+                freeaddrinfo(ae->res);
+            free(ae);
+        } else if (ai_match(ae, ctx))
+            return ae;
+    }
+    return NULL;
+}
+
+static void
+ai_deliver(struct ai_ctx *ctx)
+{
+    if (!ctx->cancel)
+        ctx->cb(ctx->arg, ctx->error, ctx->res);
+    else if (ctx->res != NULL)
+        btpd_addrinfo_free(ctx->res);
+    free(ctx);
+}
+
+static void
+ai_hit_cb(void *arg)
+{
+    ai_deliver(arg);
+}
+
+/*
+ * Resolve the node and service asynchronously. The callback owns the
+ * result and frees it with btpd_addrinfo_free.
+ */
 struct ai_ctx *
 btpd_addrinfo(const char *node, uint16_t port, struct addrinfo *hints,
     void (*cb)(void *, int, struct addrinfo *), void *arg)
 {
+    struct ai_entry *ae;
     struct ai_ctx *ctx = btpd_calloc(1, sizeof(*ctx));
     ctx->hints = *hints;
     ctx->cb = cb;
@@ -32,10 +138,30 @@ btpd_addrinfo(const char *node, uint16_t port, struct addrinfo *hints,
     ctx->port = port;
     snprintf(ctx->service, sizeof(ctx->service), "%hu", port);
 
-    pthread_mutex_lock(&m_aiq_lock);
-    BTPDQ_INSERT_TAIL(&m_aiq, ctx, entry);
-    pthread_mutex_unlock(&m_aiq_lock);
-    pthread_cond_signal(&m_aiq_cond);
+    if ((ae = ai_lookup(ctx)) != NULL && ae->resolving)
+        BTPDQ_INSERT_TAIL(&ae->waiting, ctx, entry);
+    else if (ae != NULL) {
+        // Answer from the cache, but not before the caller has returned.
+        ctx->error = ae->error;
+        ctx->res = ai_dup(ae->res);
+        td_post_begin();
+        td_post(ai_hit_cb, ctx);
+        td_post_end();
+    } else {
+        ae = btpd_calloc(1, sizeof(*ae));
+        BTPDQ_INIT(&ae->waiting);
+        ae->hints = ctx->hints;
+        snprintf(ae->node, sizeof(ae->node), "%s", ctx->node);
+        snprintf(ae->service, sizeof(ae->service), "%s", ctx->service);
+        ae->resolving = 1;
+        BTPDQ_INSERT_TAIL(&m_cache, ae, entry);
+        ctx->ae = ae;
+
+        pthread_mutex_lock(&m_aiq_lock);
+        BTPDQ_INSERT_TAIL(&m_aiq, ctx, entry);
+        pthread_mutex_unlock(&m_aiq_lock);
+        pthread_cond_signal(&m_aiq_cond);
+    }
 
     return ctx;
 }
@@ -49,12 +175,22 @@ btpd_addrinfo_cancel(struct ai_ctx *ctx)
 static void
 addrinfo_td_cb(void *arg)
 {
-    struct ai_ctx *ctx = arg;
-    if (!ctx->cancel)
-        ctx->cb(ctx->arg, ctx->error, ctx->res);
-    else if (ctx->res != NULL)
-        freeaddrinfo(ctx->res);
-    free(ctx);
+    struct ai_ctx *ctx = arg, *w;
+    struct ai_entry *ae = ctx->ae;
+
+    ae->resolving = 0;
+    ae->error = ctx->error;
+    ae->res = ctx->error == 0 ? ctx->res : NULL;
+    ae->expires = btpd_seconds + (ae->error ? AI_NEG_TTL : AI_TTL);
+
+    ctx->res = ai_dup(ae->res);
+    ai_deliver(ctx);
+    while ((w = BTPDQ_FIRST(&ae->waiting)) != NULL) {
+        BTPDQ_REMOVE(&ae->waiting, w, entry);
+        w->error = ae->error;
+        w->res = ai_dup(ae->res);
+        ai_deliver(w);
+    }
 }
 
 static void *
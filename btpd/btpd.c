@@ -86,6 +86,7 @@ heartbeat_cb(int fd, short type, void *arg)
 void tr_init(void);
 void ipc_init(void);
 void td_init(void);
+void worker_init(void);
 void addrinfo_init(void);
 
 void
@@ -122,11 +123,14 @@ btpd_init(void)
     srandom(seed);
 
     td_init();
+    worker_init();
+    pool_init();
     addrinfo_init();
     net_init();
     ipc_init();
     ul_init();
     cm_init();
+    cache_init();
     tr_init();
     tlib_init();
 
@@ -27,6 +27,7 @@
 #include <unistd.h>
 
 #include <benc.h>
+#include <bitset.h>
 #define DAEMON
 #include <btpd_if.h>
 #undef DAEMON
@@ -37,7 +38,10 @@
 
 #include "active.h"
 #include "hashtable.h"
+#include "pool.h"
 #include "net_buf.h"
+#include "outq.h"
+#include "rate.h"
 #include "net_types.h"
 #include "net.h"
 #include "peer.h"
@@ -46,6 +50,7 @@
 #include "download.h"
 #include "upload.h"
 #include "content.h"
+#include "cache.h"
 #include "opts.h"
 #include "tracker_req.h"
 
@@ -101,10 +106,13 @@ void td_post(void (*cb)(void *), void *arg);
 void td_post_end();
 #define td_post_begin td_acquire_lock
 
+void btpd_work(void (*work)(void *), void (*done)(void *), void *arg);
+
 typedef struct ai_ctx * aictx_t;
 aictx_t btpd_addrinfo(const char *node, uint16_t port, struct addrinfo *hints,
     void (*cb)(void *, int, struct addrinfo *), void *arg);
 void btpd_addrinfo_cancel(aictx_t ctx); 
+void btpd_addrinfo_free(struct addrinfo *ai);
 
 
 typedef struct nameconn *nameconn_t;
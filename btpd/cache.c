@@ -0,0 +1,255 @@
+#include "btpd.h"
+
+#define CACHE_STATS_INTERVAL 3600
+
+/*
+ * A cache of blocks read from disk for uploading. Blocks are shared by
+ * all peers that request them and are reference counted. A block is put
+ * in the cache as soon as its read starts, and requests for it made
+ * before the read is done wait for that read. Blocks nobody holds are
+ * kept in LRU order and are freed when the cached blocks use more than
+ * cache_size bytes.
+ */
+
+struct cache_key {
+    struct torrent *tp;
+    uint32_t piece;
+    uint32_t begin;
+};
+
+// A request waiting for a block to be read.
+struct cache_wait {
+    void (*done)(void *, int, uint8_t *);
+    void *arg;
+    BTPDQ_ENTRY(cache_wait) entry;
+};
+
+BTPDQ_HEAD(cache_wait_tq, cache_wait);
+
+struct cache_block {
+    struct cache_key key;
+    HTBL_ENTRY(chain);
+    BTPDQ_ENTRY(cache_block) entry;
+    struct cache_wait_tq waiters;
+    unsigned refs;
+    int cached;
+    int pending;    // Still being read.
+    size_t len;
+    uint8_t data[];
+};
+
+BTPDQ_HEAD(cache_block_tq, cache_block);
+
+HTBL_TYPE(cbtbl, cache_block, struct cache_key, key, chain);
+
+// Whole blocks come from the pool, other sizes are allocated.
+static struct pool m_cb_pool = POOL_INITIALIZER("cache_block",
+    sizeof(struct cache_block) + PIECE_BLOCKLEN, 64);
+
+static struct cbtbl *m_cbtbl;
+static struct cache_block_tq m_lru = BTPDQ_HEAD_INITIALIZER(m_lru);
+static size_t m_cache_bytes;    // Size of the blocks in the table.
+static unsigned long long m_hits, m_misses;
+static struct timeout m_statsev;
+
+static int
+cache_key_eq(const void *k1, const void *k2)
+{
+    const struct cache_key *a = k1, *b = k2;
+    return a->tp == b->tp && a->piece == b->piece && a->begin == b->begin;
+}
+
+static uint32_t
+cache_key_hash(const void *k)
+{
+    const struct cache_key *a = k;
+    return (uint32_t)(uintptr_t)a->tp ^ (a->piece * 2654435761U)
+        ^ (a->begin / PIECE_BLOCKLEN);
+}
+
+static void
+cache_block_free(struct cache_block *cb)
+{
+    if (cb->len == PIECE_BLOCKLEN)
+        pool_put(&m_cb_pool, cb);
+    else
+        free(cb);
+}
+
+/*
+ * Remove a block from the table. A block that is still held will be
+ * freed when it's released.
+ */
+static void
+cache_uncache(struct cache_block *cb)
+{
+    cb->cached = 0;
+    m_cache_bytes -= cb->len;
+    if (cb->refs == 0) {
+        BTPDQ_REMOVE(&m_lru, cb, entry);
+        cache_block_free(cb);
+    }
+}
+
+static void
+cache_shrink(void)
+{
+    struct cache_block *cb;
+    while (m_cache_bytes > cache_size && (cb = BTPDQ_FIRST(&m_lru)) != NULL) {
+        cbtbl_remove(m_cbtbl, &cb->key);
+        cache_uncache(cb);
+    }
+}
+
+static void
+cache_wait(struct cache_block *cb, void (*done)(void *, int, uint8_t *),
+    void *arg)
+{
+    struct cache_wait *cw = btpd_calloc(1, sizeof(*cw));
+    cw->done = done;
+    cw->arg = arg;
+    BTPDQ_INSERT_TAIL(&cb->waiters, cw, entry);
+}
+
+/*
+ * Pass the read block to the requests waiting for it. Each of them
+ * holds the block. If the read failed they lose their hold.
+ */
+static void
+cache_read_done(void *arg, int err)
+{
+    struct cache_block *cb = arg;
+    struct cache_wait *cw;
+
+    cb->pending = 0;
+    if (err != 0 && cb->cached) {
+        cbtbl_remove(m_cbtbl, &cb->key);
+        cache_uncache(cb);
+    }
+    // The waiters may release the block, so hold it until they're done.
+    cb->refs++;
+    while ((cw = BTPDQ_FIRST(&cb->waiters)) != NULL) {
+        BTPDQ_REMOVE(&cb->waiters, cw, entry);
+        if (err != 0)
+            cb->refs--;
+        cw->done(cw->arg, err, err == 0 ? cb->data : NULL);
+        free(cw);
+    }
+    cache_release(cb->data);
+}
+
+/*
+ * Get a held block of torrent data. The data must be released with
+ * cache_release when it's no longer used. Only whole blocks are cached.
+ *
+ * Returns 0 and sets buf if the block is cached. Otherwise the block
+ * is read on a worker thread, unless that's already being done, EAGAIN
+ * is returned and done is called with the result when the read has
+ * finished.
+ */
+int
+cache_get(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
+    uint8_t **buf, void (*done)(void *, int, uint8_t *), void *arg)
+{
+    int err, cacheable;
+    struct cache_block *cb;
+    struct cache_key key = { tp, piece, begin };
+    uint32_t nblocks = torrent_piece_blocks(tp, piece);
+
+    cacheable = cache_size > 0 && begin % PIECE_BLOCKLEN == 0
+        && len == torrent_block_size(tp, piece, nblocks,
+            begin / PIECE_BLOCKLEN);
+
+    if (cacheable && (cb = cbtbl_find(m_cbtbl, &key)) != NULL) {
+        m_hits++;
+        if (cb->refs == 0)
+            BTPDQ_REMOVE(&m_lru, cb, entry);
+        cb->refs++;
+        if (cb->pending) {
+            cache_wait(cb, done, arg);
+            return EAGAIN;
+        }
+        *buf = cb->data;
+        return 0;
+    }
+
+    m_misses++;
+    if (len == PIECE_BLOCKLEN)
+        cb = pool_get(&m_cb_pool);
+    else
+        cb = btpd_malloc(sizeof(*cb) + len);
+    cb->key = key;
+    cb->refs = 1;
+    cb->cached = 0;
+    cb->pending = 1;
+    cb->len = len;
+    BTPDQ_INIT(&cb->waiters);
+    if ((err = cm_read_async(tp, piece, begin, len, cb->data,
+             cache_read_done, cb)) != 0) {
+        cache_block_free(cb);
+        return err;
+    }
+    if (cacheable) {
+        cb->cached = 1;
+        cbtbl_insert(m_cbtbl, cb);
+        m_cache_bytes += len;
+        cache_shrink();
+    }
+    cache_wait(cb, done, arg);
+    return EAGAIN;
+}
+
+void
+cache_release(uint8_t *buf)
+{
+    struct cache_block *cb = (struct cache_block *)
+        (buf - offsetof(struct cache_block, data));
+    assert(cb->refs > 0);
+    cb->refs--;
+    if (cb->refs > 0)
+        return;
+    if (cb->cached) {
+        BTPDQ_INSERT_TAIL(&m_lru, cb, entry);
+        cache_shrink();
+    } else
+        cache_block_free(cb);
+}
+
+/*
+ * Drop the cached blocks of a torrent. Called when the torrent's content
+ * is stopped, since its files may change before it's started again.
+ */
+void
+cache_flush(struct torrent *tp)
+{
+    struct htbl_iter it;
+    struct cache_block *cb = cbtbl_iter_first(m_cbtbl, &it);
+    while (cb != NULL) {
+        if (cb->key.tp == tp) {
+            struct cache_block *next = cbtbl_iter_del(&it);
+            cache_uncache(cb);
+            cb = next;
+        } else
+            cb = cbtbl_iter_next(&it);
+    }
+}
+
+static void
+stats_cb(int fd, short type, void *arg)
+{
+    btpd_log(BTPD_L_BTPD, "block cache: %zu bytes, %llu hits, %llu misses.\n",
+        m_cache_bytes, m_hits, m_misses);
+    btpd_timer_add(&m_statsev,
+        (& (struct timespec) { CACHE_STATS_INTERVAL, 0 }));
+}
+
+void
+cache_init(void)
+{
+    m_cbtbl = cbtbl_create(1, cache_key_eq, cache_key_hash);
+    if (m_cbtbl == NULL)
+        btpd_err("Out of memory.\n");
+    evtimer_init(&m_statsev, stats_cb, NULL);
+    btpd_timer_add(&m_statsev,
+        (& (struct timespec) { CACHE_STATS_INTERVAL, 0 }));
+}
@@ -0,0 +1,11 @@
+#ifndef BTPD_CACHE_H
+#define BTPD_CACHE_H
+
+void cache_init(void);
+
+int cache_get(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
+    uint8_t **buf, void (*done)(void *, int, uint8_t *), void *arg);
+void cache_release(uint8_t *buf);
+void cache_flush(struct torrent *tp);
+
+#endif
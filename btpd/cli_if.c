@@ -46,6 +46,7 @@ static void
 write_ans(struct iobuf *iob, struct tlib *tl, enum ipc_tval val)
 {
     enum ipc_tstate ts = IPC_TSTATE_INACTIVE;
+    unsigned limit;
     switch (val) {
     case IPC_TVAL_CGOT:
         iobuf_print(iob, "i%dei%llde", IPC_TYPE_NUM,
@@ -73,20 +74,32 @@ write_ans(struct iobuf *iob, struct tlib *tl, enum ipc_tval val)
         if (tl->tp == NULL)
             iobuf_print(iob, "i%dei%de", IPC_TYPE_NUM, 0);
         else {
-            unsigned long pcseen = 0;
-            for (unsigned long i = 0; i < tl->tp->npieces; i++)
-                if (tl->tp->net->piece_count[i] > 0)
-                    pcseen++;
+            struct net *n = tl->tp->net;
+            unsigned long pcseen =
+                n->nseeds > 0 ? tl->tp->npieces : n->npcs_seen;
             iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM, pcseen);
         }
         return;
     case IPC_TVAL_RATEDWN:
-        iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM,
-            tl->tp == NULL ? 0UL : tl->tp->net->rate_dwn / RATEHISTORY);
+        iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM, tl->tp == NULL ? 0UL :
+            rate_get(&tl->tp->net->rate_dwn, ipc_rate_window));
         return;
     case IPC_TVAL_RATEUP:
-        iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM,
-            tl->tp == NULL ? 0UL : tl->tp->net->rate_up / RATEHISTORY);
+        iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM, tl->tp == NULL ? 0UL :
+            rate_get(&tl->tp->net->rate_up, ipc_rate_window));
+        return;
+    case IPC_TVAL_UPLIMIT:
+        // The lower of the torrent's and the global limit, if any.
+        if (tl->bw_limit_out > 0 && net_bw_limit_out > 0)
+            limit = min(tl->bw_limit_out, net_bw_limit_out);
+        else
+            limit = max(tl->bw_limit_out, net_bw_limit_out);
+        iobuf_print(iob, "i%dei%ue", IPC_TYPE_NUM, limit);
+        return;
+    case IPC_TVAL_CHOKER:
+        iobuf_print(iob, "i%dei%de", IPC_TYPE_NUM,
+            tl->seed_choker != IPC_CHOKER_DEFAULT ?
+            tl->seed_choker : net_seed_choker);
         return;
     case IPC_TVAL_SESSDWN:
         iobuf_print(iob, "i%dei%llde", IPC_TYPE_NUM,
@@ -422,6 +435,79 @@ cmd_rate(struct cli *cli, int argc, const char *args)
     return write_code_buffer(cli, IPC_OK);
 }
 
+static int
+cmd_trate(struct cli *cli, int argc, const char *args)
+{
+    struct tlib *tl;
+    long long up, down, weight;
+
+    if (argc != 4)
+        return IPC_COMMERR;
+    if (btpd_is_stopping())
+        return write_code_buffer(cli, IPC_ESHUTDOWN);
+
+    if (benc_isstr(args) && benc_strlen(args) == 20)
+        tl = tlib_by_hash(benc_mem(args, NULL, &args));
+    else if (benc_isint(args))
+        tl = tlib_by_num(benc_int(args, &args));
+    else
+        return IPC_COMMERR;
+
+    if (benc_isint(args))
+        up = benc_int(args, &args);
+    else
+        return IPC_COMMERR;
+
+    if (benc_isint(args))
+        down = benc_int(args, &args);
+    else
+        return IPC_COMMERR;
+
+    if (benc_isint(args))
+        weight = benc_int(args, &args);
+    else
+        return IPC_COMMERR;
+    if (up < 0 || up > UINT_MAX || down < 0 || down > UINT_MAX
+            || weight < 0 || weight > UINT_MAX)
+        return IPC_COMMERR;
+
+    if (tl == NULL || torrent_haunting(tl))
+        return write_code_buffer(cli, IPC_ENOTENT);
+    tlib_set_rate(tl, up, down, weight);
+    return write_code_buffer(cli, IPC_OK);
+}
+
+static int
+cmd_choker(struct cli *cli, int argc, const char *args)
+{
+    struct tlib *tl;
+    long long choker;
+
+    if (argc != 2)
+        return IPC_COMMERR;
+    if (btpd_is_stopping())
+        return write_code_buffer(cli, IPC_ESHUTDOWN);
+
+    if (benc_isstr(args) && benc_strlen(args) == 20)
+        tl = tlib_by_hash(benc_mem(args, NULL, &args));
+    else if (benc_isint(args))
+        tl = tlib_by_num(benc_int(args, &args));
+    else
+        return IPC_COMMERR;
+
+    if (benc_isint(args))
+        choker = benc_int(args, &args);
+    else
+        return IPC_COMMERR;
+    if (choker < IPC_CHOKER_DEFAULT || choker > IPC_CHOKER_ROUNDROBIN)
+        return IPC_COMMERR;
+
+    if (tl == NULL || torrent_haunting(tl))
+        return write_code_buffer(cli, IPC_ENOTENT);
+    tlib_set_choker(tl, choker);
+    return write_code_buffer(cli, IPC_OK);
+}
+
 static int
 cmd_die(struct cli *cli, int argc, const char *args)
 {
@@ -439,6 +525,7 @@ static struct {
     int (*fun)(struct cli *cli, int, const char *);
 } cmd_table[] = {
     { "add",    3, cmd_add },
+    { "choker", 6, cmd_choker },
     { "del",    3, cmd_del },
     { "die",    3, cmd_die },
     { "rate",   4, cmd_rate },
@@ -446,7 +533,8 @@ static struct {
     { "start-all", 9, cmd_start_all},
     { "stop",   4, cmd_stop },
     { "stop-all", 8, cmd_stop_all},
-    { "tget",   4, cmd_tget }
+    { "tget",   4, cmd_tget },
+    { "trate",  5, cmd_trate }
 };
 
 static int
@@ -3,11 +3,48 @@
 #include <openssl/sha.h>
 #include <stream.h>
 
+/*
+ * A piece test waiting for the piece's blocks to reach the disk.
+ */
+struct deferred_test {
+    uint32_t piece;
+    int have_hash;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    BTPDQ_ENTRY(deferred_test) entry;
+};
+
+BTPDQ_HEAD(deferred_tq, deferred_test);
+
+/*
+ * A write to a piece that is being preallocated. It's held until the
+ * piece has been filled with zeros.
+ */
+struct held_write {
+    uint32_t piece;
+    void (*work)(void *);
+    void (*done)(void *);
+    void *arg;
+    BTPDQ_ENTRY(held_write) entry;
+};
+
+BTPDQ_HEAD(held_write_tq, held_write);
+
+BTPDQ_HEAD(wbuf_tq, wbuf);
+
 struct content {
-    enum { CM_INACTIVE, CM_STARTING, CM_ACTIVE } state;
+    enum { CM_INACTIVE, CM_STARTING, CM_ACTIVE, CM_STOPPING } state;
 
     int error;
 
+    unsigned njobs; // jobs on the worker threads
+
+    uint16_t *piece_writes; // pending block writes per piece
+    struct deferred_tq deferred; // tests waiting for writes
+    struct held_write_tq held; // writes waiting for preallocation
+
+    struct wbuf **wbufs; // write buffer per piece, or NULL
+    struct wbuf_tq wbufq; // write buffers, least recently touched first
+
     uint32_t npieces_got;
 
     off_t ncontent_bytes;
@@ -17,6 +54,7 @@ struct content {
     uint8_t *piece_field;
     uint8_t *block_field;
     uint8_t *pos_field;
+    uint8_t *fill_field; // pieces being preallocated
 
     struct bt_stream *rds;
     struct bt_stream *wrs;
@@ -35,6 +73,23 @@ fd_cb_rd(const char *path, int *fd, void *arg)
     return vopen(fd, O_RDONLY, "%s/%s", tp->tl->dir, path);
 }
 
+/*
+ * Used when testing pieces at startup, which reads the files from
+ * start to end.
+ */
+static int
+fd_cb_seq(const char *path, int *fd, void *arg)
+{
+    int err;
+    struct torrent *tp = arg;
+    if ((err = vopen(fd, O_RDONLY, "%s/%s", tp->tl->dir, path)) != 0)
+        return err;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(*fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return 0;
+}
+
 static int
 fd_cb_wr(const char *path, int *fd, void *arg)
 {
@@ -46,6 +101,9 @@ struct start_test_data {
     struct torrent *tp;
     struct file_time_size *fts;
     uint32_t start;
+    unsigned npending;
+    off_t ntested;
+    struct timespec began;
     BTPDQ_ENTRY(start_test_data) entry;
 };
 
@@ -55,37 +113,83 @@ static struct std_tq m_startq = BTPDQ_HEAD_INITIALIZER(m_startq);
 
 static struct timeout m_workev;
 
-#define READBUFLEN (1 << 14)
+// The number of bytes to test in one job at startup.
+#define HASHRUNLEN (1 << 24)
+
+struct hash_job {
+    struct torrent *tp;
+    uint32_t piece;
+    uint32_t npieces;
+    int startup;
+    int err;
+    const char *errfile;
+    uint8_t (*hashes)[SHA_DIGEST_LENGTH];
+};
 
 static int
-test_hash(struct torrent *tp, uint8_t *hash, uint32_t piece)
+test_hash(struct torrent *tp, const uint8_t *hash, uint32_t piece)
 {
     char piece_hash[SHA_DIGEST_LENGTH];
     tlib_read_hash(tp->tl, tp->pieces_off, piece, piece_hash);
     return bcmp(hash, piece_hash, SHA_DIGEST_LENGTH);
 }
 
-static int
-test_piece(struct torrent *tp, uint32_t piece, int *ok)
+static void
+hash_job_cb(uint32_t i, uint8_t *hash, void *arg)
 {
-    int err;
-    uint8_t hash[SHA_DIGEST_LENGTH];
-    if ((err = bts_sha(tp->cm->rds, piece * tp->piece_length,
-             torrent_piece_size(tp, piece), hash)) != 0) {
-        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
-            bts_filename(tp->cm->rds), strerror(err));
-        return err;;
-    }
-    *ok = test_hash(tp, hash, piece) == 0;
-    return 0;
+    struct hash_job *hj = arg;
+    bcopy(hash, hj->hashes[i], SHA_DIGEST_LENGTH);
 }
 
-static int test_hash(struct torrent *tp, uint8_t *hash, uint32_t piece);
+/*
+ * Runs on a worker thread. Tests at startup read the files from start to
+ * end and get a stream of their own, opened for sequential reads. Other
+ * tests use the content's read stream.
+ */
+static void
+hash_job_work(void *arg)
+{
+    struct hash_job *hj = arg;
+    struct torrent *tp = hj->tp;
+    struct bt_stream *bts = tp->cm->rds;
+    unsigned fi;
+    off_t off = hj->piece * tp->piece_length;
+    if (hj->startup && (hj->err = bts_open(&bts, tp->nfiles, tp->files,
+             fd_cb_seq, tp)) != 0)
+        return;
+    if (hj->npieces == 1)
+        hj->err = bts_sha(bts, off, torrent_piece_size(tp, hj->piece),
+            hj->hashes[0], &fi);
+    else
+        hj->err = bts_sha_run(bts, off,
+            min(tp->total_length - off, hj->npieces * tp->piece_length),
+            tp->piece_length, hash_job_cb, hj, &fi);
+    if (hj->err != 0)
+        hj->errfile = bts_filename(bts, fi);
+    if (hj->startup)
+        bts_close(bts);
+}
+
+static void hash_job_done(void *arg);
+
+static void
+hash_job_submit(struct torrent *tp, uint32_t piece, uint32_t npieces,
+    int startup)
+{
+    struct hash_job *hj = btpd_calloc(1, sizeof(*hj));
+    hj->tp = tp;
+    hj->piece = piece;
+    hj->npieces = npieces;
+    hj->startup = startup;
+    hj->hashes = btpd_calloc(npieces, sizeof(*hj->hashes));
+    tp->cm->njobs++;
+    btpd_work(hash_job_work, hash_job_done, hj);
+}
 
 static void startup_test_run(void);
 
-void
-worker_cb(int fd, short type, void *arg)
+static void
+startup_cb(int fd, short type, void *arg)
 {
     startup_test_run();
 }
@@ -96,6 +200,9 @@ cm_kill(struct torrent *tp)
     struct content *cm = tp->cm;
     tlib_close_resume(cm->resd);
     free(cm->pos_field);
+    free(cm->fill_field);
+    free(cm->piece_writes);
+    free(cm->wbufs);
     free(cm);
     tp->cm = NULL;
 }
@@ -137,6 +244,225 @@ cm_write_done(struct torrent *tp)
         cm_save(tp);
 }
 
+static void
+cm_stop_end(struct torrent *tp)
+{
+    struct content *cm = tp->cm;
+    if (cm->rds != NULL) {
+        bts_close(cm->rds);
+        cm->rds = NULL;
+    }
+    if (cm->wrs != NULL)
+        cm_write_done(tp);
+    cm->state = CM_INACTIVE;
+}
+
+/*
+ * Called from the done callbacks of the worker thread jobs. Returns 0
+ * if the content is being stopped and the job's result is unwanted.
+ */
+static int
+cm_job_end(struct torrent *tp)
+{
+    struct content *cm = tp->cm;
+    assert(cm->njobs > 0);
+    cm->njobs--;
+    if (cm->state != CM_STOPPING)
+        return 1;
+    if (cm->njobs == 0)
+        cm_stop_end(tp);
+    return 0;
+}
+
+static void cm_run_deferred(struct torrent *tp, uint32_t piece);
+
+/*
+ * Blocks of pieces being downloaded are collected in per piece write
+ * buffers, and written with as few writes as possible when the piece is
+ * complete, when the buffers use more than cm_wbuf_size bytes, or when
+ * a buffer hasn't been touched for WBUF_IDLE seconds. A complete piece
+ * is hashed from its buffer as it's written.
+ */
+#define WBUF_IDLE 30
+
+struct wbuf {
+    struct torrent *tp;
+    uint32_t piece;
+    uint32_t nblocks;
+    uint32_t ngot;
+    long t_touched;
+    int hash_it;
+    int err;
+    const char *errfile;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    uint8_t *block_field;
+    uint8_t *data;
+    BTPDQ_ENTRY(wbuf) entry;
+    BTPDQ_ENTRY(wbuf) tp_entry;
+};
+
+// All write buffers, least recently touched first.
+static struct wbuf_tq m_wbufq = BTPDQ_HEAD_INITIALIZER(m_wbufq);
+static size_t m_wbuf_bytes;
+
+static void
+wbuf_work(void *arg)
+{
+    struct wbuf *wb = arg;
+    struct torrent *tp = wb->tp;
+    struct bt_stream *wrs = tp->cm->wrs;
+    off_t off = wb->piece * tp->piece_length;
+    uint32_t i = 0;
+    unsigned fi;
+
+    if (wb->hash_it)
+        SHA1(wb->data, torrent_piece_size(tp, wb->piece), wb->hash);
+    // Write each run of consecutive blocks with one write.
+    while (i < wb->nblocks) {
+        uint32_t start, end;
+        if ((i = bitset_next(wb->block_field, wb->nblocks, i)) == wb->nblocks)
+            break;
+        start = i;
+        i = bitset_next_clear(wb->block_field, wb->nblocks, i);
+        end = i == wb->nblocks ? torrent_piece_size(tp, wb->piece)
+            : i * PIECE_BLOCKLEN;
+        if ((wb->err = bts_put(wrs, off + start * PIECE_BLOCKLEN,
+                 wb->data + start * PIECE_BLOCKLEN,
+                 end - start * PIECE_BLOCKLEN, &fi)) != 0) {
+            wb->errfile = bts_filename(wrs, fi);
+            break;
+        }
+    }
+}
+
+static void
+wbuf_free(struct wbuf *wb)
+{
+    free(wb->block_field);
+    free(wb->data);
+    free(wb);
+}
+
+static void
+wbuf_done(void *arg)
+{
+    struct wbuf *wb = arg;
+    struct torrent *tp = wb->tp;
+    struct content *cm = tp->cm;
+    assert(cm->piece_writes[wb->piece] > 0);
+    cm->piece_writes[wb->piece]--;
+    if (cm_job_end(tp)) {
+        if (wb->err != 0) {
+            btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+                wb->errfile, strerror(wb->err));
+            cm_on_error(tp);
+        } else if (wb->hash_it)
+            cm_test_piece_hash(tp, wb->piece, wb->hash);
+        else if (cm->piece_writes[wb->piece] == 0)
+            cm_run_deferred(tp, wb->piece);
+    }
+    wbuf_free(wb);
+}
+
+static void
+wbuf_unlink(struct wbuf *wb)
+{
+    struct content *cm = wb->tp->cm;
+    BTPDQ_REMOVE(&m_wbufq, wb, entry);
+    BTPDQ_REMOVE(&cm->wbufq, wb, tp_entry);
+    cm->wbufs[wb->piece] = NULL;
+    m_wbuf_bytes -= torrent_piece_size(wb->tp, wb->piece);
+}
+
+/*
+ * Start a write to the piece on a worker thread. If the piece is being
+ * preallocated the write is held until that is done, or the zeros could
+ * overwrite it.
+ */
+static void
+cm_write(struct torrent *tp, uint32_t piece, void (*work)(void *),
+    void (*done)(void *), void *arg)
+{
+    struct content *cm = tp->cm;
+    cm->piece_writes[piece]++;
+    cm->njobs++;
+    if (has_bit(cm->fill_field, piece)) {
+        struct held_write *hw = btpd_calloc(1, sizeof(*hw));
+        hw->piece = piece;
+        hw->work = work;
+        hw->done = done;
+        hw->arg = arg;
+        BTPDQ_INSERT_TAIL(&cm->held, hw, entry);
+    } else
+        btpd_work(work, done, arg);
+}
+
+static void
+wbuf_flush(struct wbuf *wb, int hash_it)
+{
+    wbuf_unlink(wb);
+    wb->hash_it = hash_it;
+    cm_write(wb->tp, wb->piece, wbuf_work, wbuf_done, wb);
+}
+
+static struct wbuf *
+wbuf_find(struct torrent *tp, uint32_t piece)
+{
+    return tp->cm->wbufs[piece];
+}
+
+static void
+wbuf_put(struct torrent *tp, uint32_t piece, uint32_t begin,
+    const uint8_t *buf, size_t len)
+{
+    struct content *cm = tp->cm;
+    struct wbuf *wb = wbuf_find(tp, piece);
+    if (wb == NULL) {
+        wb = btpd_calloc(1, sizeof(*wb));
+        wb->tp = tp;
+        wb->piece = piece;
+        wb->nblocks = torrent_piece_blocks(tp, piece);
+        wb->block_field = btpd_calloc(ceil(wb->nblocks / 8.0), 1);
+        wb->data = btpd_malloc(torrent_piece_size(tp, piece));
+        cm->wbufs[piece] = wb;
+        m_wbuf_bytes += torrent_piece_size(tp, piece);
+    } else {
+        BTPDQ_REMOVE(&m_wbufq, wb, entry);
+        BTPDQ_REMOVE(&cm->wbufq, wb, tp_entry);
+    }
+    BTPDQ_INSERT_TAIL(&m_wbufq, wb, entry);
+    BTPDQ_INSERT_TAIL(&cm->wbufq, wb, tp_entry);
+    wb->t_touched = btpd_seconds;
+    bcopy(buf, wb->data + begin, len);
+    set_bit(wb->block_field, begin / PIECE_BLOCKLEN);
+    wb->ngot++;
+
+    while (m_wbuf_bytes > cm_wbuf_size)
+        wbuf_flush(BTPDQ_FIRST(&m_wbufq), 0);
+}
+
+/*
+ * Write the buffers of the torrent. Only the idle ones unless all is set.
+ */
+static void
+wbuf_flush_torrent(struct torrent *tp, int all)
+{
+    struct wbuf *wb;
+    while ((wb = BTPDQ_FIRST(&tp->cm->wbufq)) != NULL
+            && (all || btpd_seconds - wb->t_touched >= WBUF_IDLE))
+        wbuf_flush(wb, 0);
+}
+
+static void
+wbuf_drop_torrent(struct torrent *tp)
+{
+    struct wbuf *wb;
+    while ((wb = BTPDQ_FIRST(&tp->cm->wbufq)) != NULL) {
+        wbuf_unlink(wb);
+        wbuf_free(wb);
+    }
+}
+
 void
 cm_stop(struct torrent *tp)
 {
@@ -149,6 +475,9 @@ cm_stop(struct torrent *tp)
         struct start_test_data *std;
         BTPDQ_FOREACH(std, &m_startq, entry)
             if (std->tp == tp) {
+                if (std == BTPDQ_FIRST(&m_startq)
+                        && BTPDQ_NEXT(std, entry) != NULL)
+                    btpd_timer_add(&m_workev, (& (struct timespec) { 0, 0 }));
                 BTPDQ_REMOVE(&m_startq, std, entry);
                 free(std->fts);
                 free(std);
@@ -156,12 +485,22 @@ cm_stop(struct torrent *tp)
             }
     }
 
-    if (cm->rds != NULL)
-        bts_close(cm->rds);
-    if (cm->wrs != NULL)
-        cm_write_done(tp);
+    cache_flush(tp);
+    if (!cm->error)
+        wbuf_flush_torrent(tp, 1);
+    else
+        wbuf_drop_torrent(tp);
+    struct deferred_test *dt;
+    while ((dt = BTPDQ_FIRST(&cm->deferred)) != NULL) {
+        BTPDQ_REMOVE(&cm->deferred, dt, entry);
+        free(dt);
+    }
 
-    cm->state = CM_INACTIVE;
+    // The outstanding jobs use the streams. Wait for them before closing
+    // the streams and letting the torrent die.
+    cm->state = CM_STOPPING;
+    if (cm->njobs == 0)
+        cm_stop_end(tp);
 }
 
 int
@@ -191,6 +530,12 @@ cm_create(struct torrent *tp, const char *mi)
     struct content *cm = btpd_calloc(1, sizeof(*cm));
     cm->bppbf = ceil((double)tp->piece_length / (1 << 17));
     cm->pos_field = btpd_calloc(pfield_size, 1);
+    cm->fill_field = btpd_calloc(pfield_size, 1);
+    cm->piece_writes = btpd_calloc(tp->npieces, sizeof(*cm->piece_writes));
+    BTPDQ_INIT(&cm->deferred);
+    BTPDQ_INIT(&cm->held);
+    cm->wbufs = btpd_calloc(tp->npieces, sizeof(*cm->wbufs));
+    BTPDQ_INIT(&cm->wbufq);
     cm->resd = tlib_open_resume(tp->tl, tp->nfiles, pfield_size,
         cm->bppbf * tp->npieces);
     cm->piece_field = resume_piece_field(cm->resd);
@@ -207,16 +552,135 @@ cm_get_bytes(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
         return EIO;
 
     *buf = btpd_malloc(len);
+    return cm_read_bytes(tp, piece, begin, len, *buf);
+}
+
+int
+cm_read_bytes(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
+    uint8_t *buf)
+{
+    if (tp->cm->error)
+        return EIO;
+
+    unsigned fi;
     int err =
-        bts_get(tp->cm->rds, piece * tp->piece_length + begin, *buf, len);
+        bts_get(tp->cm->rds, piece * tp->piece_length + begin, buf, len, &fi);
     if (err != 0) {
         btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
-            bts_filename(tp->cm->rds), strerror(err));
+            bts_filename(tp->cm->rds, fi), strerror(err));
         cm_on_error(tp);
     }
     return err;
 }
 
+struct read_job {
+    struct torrent *tp;
+    off_t off;
+    size_t len;
+    uint8_t *buf;
+    int err;
+    const char *errfile;
+    void (*cb)(void *, int);
+    void *arg;
+};
+
+static void
+read_job_work(void *arg)
+{
+    struct read_job *rj = arg;
+    struct bt_stream *rds = rj->tp->cm->rds;
+    unsigned fi;
+    if ((rj->err = bts_get(rds, rj->off, rj->buf, rj->len, &fi)) != 0)
+        rj->errfile = bts_filename(rds, fi);
+}
+
+static void
+read_job_done(void *arg)
+{
+    struct read_job *rj = arg;
+    if (!cm_job_end(rj->tp))
+        rj->cb(rj->arg, ECANCELED);
+    else if (rj->err != 0) {
+        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+            rj->errfile, strerror(rj->err));
+        cm_on_error(rj->tp);
+        rj->cb(rj->arg, rj->err);
+    } else
+        rj->cb(rj->arg, 0);
+    free(rj);
+}
+
+/*
+ * Read data into buf on a worker thread. When it's done cb is called
+ * with the result. Returns non zero, without calling cb, if the read
+ * can't be started.
+ */
+int
+cm_read_async(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
+    uint8_t *buf, void (*cb)(void *, int), void *arg)
+{
+    if (tp->cm->error)
+        return EIO;
+
+    struct read_job *rj = btpd_calloc(1, sizeof(*rj));
+    rj->tp = tp;
+    rj->off = piece * tp->piece_length + begin;
+    rj->len = len;
+    rj->buf = buf;
+    rj->cb = cb;
+    rj->arg = arg;
+    tp->cm->njobs++;
+    btpd_work(read_job_work, read_job_done, rj);
+    return 0;
+}
+
+/*
+ * Start reading the rest of the piece from begin into the page cache,
+ * so it's there when the requested blocks are sent.
+ */
+void
+cm_prefetch(struct torrent *tp, uint32_t piece, uint32_t begin)
+{
+    if (tp->cm->error)
+        return;
+    bts_prefetch(tp->cm->rds, piece * tp->piece_length + begin,
+        torrent_piece_size(tp, piece) - begin);
+}
+
+/*
+ * Returns true if the data can be sent directly from its file, i.e. if
+ * it isn't split over several files.
+ */
+int
+cm_contiguous(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len)
+{
+    return bts_contiguous(tp->cm->rds, piece * tp->piece_length + begin, len);
+}
+
+int
+cm_get_fd(struct torrent *tp, uint32_t piece, uint32_t begin, int *fd,
+    off_t *off)
+{
+    if (tp->cm->error)
+        return EIO;
+
+    unsigned fi;
+    int err = bts_fd_get(tp->cm->rds, piece * tp->piece_length + begin,
+        fd, off, &fi);
+    if (err != 0) {
+        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+            bts_filename(tp->cm->rds, fi), strerror(err));
+        cm_on_error(tp);
+    }
+    return err;
+}
+
+void
+cm_put_fd(struct torrent *tp, uint32_t piece, uint32_t begin)
+{
+    bts_fd_put(tp->cm->rds, piece * tp->piece_length + begin);
+}
+
 void
 cm_prealloc(struct torrent *tp, uint32_t piece)
 {
@@ -226,14 +690,11 @@ cm_prealloc(struct torrent *tp, uint32_t piece)
         set_bit(cm->pos_field, piece);
 }
 
-void
-cm_test_piece(struct torrent *tp, uint32_t piece)
+static void
+cm_on_piece_tested(struct torrent *tp, uint32_t piece, int ok)
 {
-    int ok;
     struct content *cm = tp->cm;
-    if ((errno = test_piece(tp, piece, &ok)) != 0)
-        cm_on_error(tp);
-    else if (ok) {
+    if (ok) {
         assert(cm->npieces_got < tp->npieces);
         cm->npieces_got++;
         set_bit(cm->piece_field, piece);
@@ -249,11 +710,185 @@ cm_test_piece(struct torrent *tp, uint32_t piece)
     }
 }
 
+static void
+cm_defer_test(struct torrent *tp, uint32_t piece, const uint8_t *hash)
+{
+    struct deferred_test *dt = btpd_calloc(1, sizeof(*dt));
+    dt->piece = piece;
+    if (hash != NULL) {
+        dt->have_hash = 1;
+        bcopy(hash, dt->hash, SHA_DIGEST_LENGTH);
+    }
+    BTPDQ_INSERT_TAIL(&tp->cm->deferred, dt, entry);
+}
+
+void
+cm_test_piece(struct torrent *tp, uint32_t piece)
+{
+    struct wbuf *wb = wbuf_find(tp, piece);
+    if (wb != NULL && wb->ngot == wb->nblocks) {
+        // The test is done when the buffer has been written.
+        wbuf_flush(wb, 1);
+        return;
+    } else if (wb != NULL)
+        wbuf_flush(wb, 0);
+    if (tp->cm->piece_writes[piece] > 0)
+        cm_defer_test(tp, piece, NULL);
+    else
+        hash_job_submit(tp, piece, 1, 0);
+}
+
+/*
+ * Test a piece whose hash already has been computed, i.e. without
+ * reading its data back from disk.
+ */
+void
+cm_test_piece_hash(struct torrent *tp, uint32_t piece, const uint8_t *hash)
+{
+    struct wbuf *wb = wbuf_find(tp, piece);
+    if (wb != NULL)
+        wbuf_flush(wb, 0);
+    if (tp->cm->piece_writes[piece] > 0)
+        cm_defer_test(tp, piece, hash);
+    else
+        cm_on_piece_tested(tp, piece, test_hash(tp, hash, piece) == 0);
+}
+
+static void
+cm_run_deferred(struct torrent *tp, uint32_t piece)
+{
+    struct deferred_test *dt;
+    BTPDQ_FOREACH(dt, &tp->cm->deferred, entry)
+        if (dt->piece == piece)
+            break;
+    if (dt == NULL)
+        return;
+    BTPDQ_REMOVE(&tp->cm->deferred, dt, entry);
+    if (dt->have_hash)
+        cm_on_piece_tested(tp, piece, test_hash(tp, dt->hash, piece) == 0);
+    else
+        hash_job_submit(tp, piece, 1, 0);
+    free(dt);
+}
+
+struct write_job {
+    struct torrent *tp;
+    uint32_t piece;
+    off_t off;
+    size_t len;
+    int err;
+    const char *errfile;
+    uint8_t data[];
+};
+
+static struct pool m_wj_pool = POOL_INITIALIZER("write_job",
+    sizeof(struct write_job) + PIECE_BLOCKLEN, 64);
+
+static void
+write_job_free(struct write_job *wj)
+{
+    if (wj->len == PIECE_BLOCKLEN)
+        pool_put(&m_wj_pool, wj);
+    else
+        free(wj);
+}
+
+static void
+write_job_work(void *arg)
+{
+    struct write_job *wj = arg;
+    struct bt_stream *wrs = wj->tp->cm->wrs;
+    unsigned fi;
+    if ((wj->err = bts_put(wrs, wj->off, wj->data, wj->len, &fi)) != 0)
+        wj->errfile = bts_filename(wrs, fi);
+}
+
+static void
+write_job_done(void *arg)
+{
+    struct write_job *wj = arg;
+    struct torrent *tp = wj->tp;
+    struct content *cm = tp->cm;
+    assert(cm->piece_writes[wj->piece] > 0);
+    cm->piece_writes[wj->piece]--;
+    if (cm_job_end(tp)) {
+        if (wj->err != 0) {
+            btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+                wj->errfile, strerror(wj->err));
+            cm_on_error(tp);
+        } else if (cm->piece_writes[wj->piece] == 0)
+            cm_run_deferred(tp, wj->piece);
+    }
+    write_job_free(wj);
+}
+
+struct fill_job {
+    struct torrent *tp;
+    uint32_t piece;
+    int err;
+    const char *errfile;
+};
+
+static void
+fill_job_work(void *arg)
+{
+    struct fill_job *fj = arg;
+    struct torrent *tp = fj->tp;
+    struct bt_stream *wrs = tp->cm->wrs;
+    off_t len = torrent_piece_size(tp, fj->piece);
+    off_t off = tp->piece_length * fj->piece;
+    unsigned fi;
+    while (len > 0) {
+        size_t wlen = min(ZEROBUFLEN, len);
+        if ((fj->err = bts_put(wrs, off, m_zerobuf, wlen, &fi)) != 0) {
+            fj->errfile = bts_filename(wrs, fi);
+            return;
+        }
+        len -= wlen;
+        off += wlen;
+    }
+}
+
+static void
+fill_job_done(void *arg)
+{
+    struct fill_job *fj = arg;
+    struct torrent *tp = fj->tp;
+    struct content *cm = tp->cm;
+    struct held_write *hw, *next;
+
+    clear_bit(cm->fill_field, fj->piece);
+    BTPDQ_FOREACH_MUTABLE(hw, &cm->held, entry, next) {
+        if (hw->piece == fj->piece) {
+            BTPDQ_REMOVE(&cm->held, hw, entry);
+            btpd_work(hw->work, hw->done, hw->arg);
+            free(hw);
+        }
+    }
+
+    assert(cm->piece_writes[fj->piece] > 0);
+    cm->piece_writes[fj->piece]--;
+    if (cm_job_end(tp)) {
+        if (fj->err != 0) {
+            btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+                fj->errfile, strerror(fj->err));
+            cm_on_error(tp);
+        } else if (cm->piece_writes[fj->piece] == 0)
+            cm_run_deferred(tp, fj->piece);
+    }
+    free(fj);
+}
+
+void
+cm_on_tick(struct torrent *tp)
+{
+    wbuf_flush_torrent(tp, 0);
+}
+
 int
 cm_put_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
     const uint8_t *buf, size_t len)
 {
-    int err;
     struct content *cm = tp->cm;
 
     if (cm->error)
@@ -268,39 +903,43 @@ cm_put_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
         uint32_t start = piece - piece % npieces;
         uint32_t end = min(start + npieces, tp->npieces);
 
+        // The zeros are written on a worker thread. Writes to the
+        // pieces are held, and tests deferred, until that is done.
         while (start < end) {
             if (!has_bit(cm->pos_field, start)) {
                 assert(!has_bit(cm->piece_field, start));
-                off_t len = torrent_piece_size(tp, start);
-                off_t off = tp->piece_length * start;
-                while (len > 0) {
-                    size_t wlen = min(ZEROBUFLEN, len);
-                    if ((err = bts_put(cm->wrs, off, m_zerobuf, wlen)) != 0) {
-                        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
-                            bts_filename(cm->wrs), strerror(errno));
-                        cm_on_error(tp);
-                        return err;
-                    }
-
-                    len -= wlen;
-                    off += wlen;
-                }
+                struct fill_job *fj = btpd_calloc(1, sizeof(*fj));
+                fj->tp = tp;
+                fj->piece = start;
                 set_bit(cm->pos_field, start);
+                set_bit(cm->fill_field, start);
+                cm->piece_writes[start]++;
+                cm->njobs++;
+                btpd_work(fill_job_work, fill_job_done, fj);
             }
             start++;
         }
     }
-    err = bts_put(cm->wrs, piece * tp->piece_length + begin, buf, len);
-    if (err != 0) {
-        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s)\n",
-            bts_filename(cm->wrs), strerror(err));
-        cm_on_error(tp);
-        return err;
-    }
-
     cm->ncontent_bytes += len;
     set_bit(bf, begin / PIECE_BLOCKLEN);
 
+    if (torrent_piece_size(tp, piece) <= cm_wbuf_size) {
+        wbuf_put(tp, piece, begin, buf, len);
+        return 0;
+    }
+
+    // The block is written on a worker thread. Tests of the piece wait
+    // for its writes to finish.
+    struct write_job *wj = len == PIECE_BLOCKLEN ? pool_get(&m_wj_pool)
+        : btpd_malloc(sizeof(*wj) + len);
+    wj->tp = tp;
+    wj->piece = piece;
+    wj->off = piece * tp->piece_length + begin;
+    wj->len = len;
+    wj->err = 0;
+    wj->errfile = NULL;
+    bcopy(buf, wj->data, len);
+    cm_write(tp, piece, write_job_work, write_job_done, wj);
     return 0;
 }
 
@@ -383,29 +1022,30 @@ startup_test_end(struct torrent *tp, int unclean)
 {
     struct content *cm = tp->cm;
 
-    bzero(cm->pos_field, ceil(tp->npieces / 8.0));
-    for (uint32_t piece = 0; piece < tp->npieces; piece++) {
-        if (cm_has_piece(tp, piece)) {
-            cm->ncontent_bytes += torrent_piece_size(tp, piece);
-            cm->npieces_got++;
-            set_bit(cm->pos_field, piece);
-            continue;
-        }
+    bcopy(cm->piece_field, cm->pos_field, ceil(tp->npieces / 8.0));
+    uint32_t npieces_got = bitset_count(cm->piece_field, tp->npieces);
+    cm->npieces_got += npieces_got;
+    cm->ncontent_bytes += (off_t)npieces_got * tp->piece_length;
+    if (cm_has_piece(tp, tp->npieces - 1))
+        cm->ncontent_bytes -= tp->piece_length
+            - torrent_piece_size(tp, tp->npieces - 1);
+    for (uint32_t piece = bitset_next_clear(cm->piece_field, tp->npieces, 0);
+         piece < tp->npieces;
+         piece = bitset_next_clear(cm->piece_field, tp->npieces, piece + 1)) {
         uint8_t *bf = cm->block_field + cm->bppbf * piece;
         uint32_t nblocks = torrent_piece_blocks(tp, piece);
-        uint32_t nblocks_got = 0;
-        for (uint32_t i = 0; i < nblocks; i++) {
-            if (has_bit(bf, i)) {
-                nblocks_got++;
-                cm->ncontent_bytes +=
-                    torrent_block_size(tp, piece, nblocks, i);
-            }
-        }
-        if (nblocks_got == nblocks) {
+        uint32_t nblocks_got = bitset_count(bf, nblocks);
+        if (nblocks_got == 0)
+            continue;
+        else if (nblocks_got == nblocks) {
             bzero(bf, cm->bppbf);
-            cm->ncontent_bytes -= torrent_piece_size(tp, piece);
-        } else if (nblocks_got > 0)
-            set_bit(cm->pos_field, piece);
+            continue;
+        }
+        cm->ncontent_bytes += (off_t)nblocks_got * PIECE_BLOCKLEN;
+        if (has_bit(bf, nblocks - 1))
+            cm->ncontent_bytes -= PIECE_BLOCKLEN
+                - torrent_block_size(tp, piece, nblocks, nblocks - 1);
+        set_bit(cm->pos_field, piece);
     }
     if (unclean) {
         struct start_test_data *std = BTPDQ_FIRST(&m_startq);
@@ -432,40 +1072,95 @@ startup_test_end(struct torrent *tp, int unclean)
 void
 startup_test_run(void)
 {
-    int ok;
     struct torrent *tp;
     struct content *cm;
     struct start_test_data * std = BTPDQ_FIRST(&m_startq);
-    uint32_t this;
     if (std == NULL)
         return;
     tp = std->tp;
     cm = tp->cm;
-    if (test_piece(std->tp, std->start, &ok) != 0) {
-        cm_on_error(std->tp);
-        return;
+    if (std->began.tv_sec == 0 && std->began.tv_nsec == 0)
+        evtimer_gettime(&std->began);
+    // Hand out runs of consecutive pieces, so that the files are read
+    // sequentially in large chunks.
+    uint32_t maxrun = max(1, HASHRUNLEN / tp->piece_length);
+    while (std->start < tp->npieces && std->npending < 2 * wk_nthreads) {
+        uint32_t npieces = 1;
+        while (npieces < maxrun && std->start + npieces < tp->npieces
+                && has_bit(cm->pos_field, std->start + npieces))
+            npieces++;
+        hash_job_submit(tp, std->start, npieces, 1);
+        std->npending++;
+        std->start = bitset_next(cm->pos_field, tp->npieces,
+            std->start + npieces);
     }
-    if (ok)
-        set_bit(cm->piece_field, std->start);
-    else
-        clear_bit(cm->piece_field, std->start);
-    this = std->start;
-    do
-        std->start++;
-    while (std->start < tp->npieces && !has_bit(cm->pos_field, std->start));
-    if (std->start >= tp->npieces)
+}
+
+static void
+startup_test_log(struct start_test_data *std)
+{
+    struct timespec now;
+    double secs;
+    evtimer_gettime(&now);
+    secs = (now.tv_sec - std->began.tv_sec)
+        + (now.tv_nsec - std->began.tv_nsec) / 1e9;
+    btpd_log(BTPD_L_BTPD, "tested %.1f MB of '%s' in %.1f s (%.1f MB/s).\n",
+        std->ntested / 1048576.0, torrent_name(std->tp), secs,
+        secs > 0 ? std->ntested / 1048576.0 / secs : 0.0);
+}
+
+static void
+startup_test_done(struct hash_job *hj)
+{
+    struct torrent *tp = hj->tp;
+    struct content *cm = tp->cm;
+    struct start_test_data *std = BTPDQ_FIRST(&m_startq);
+    assert(std->tp == tp && std->npending > 0);
+    std->npending--;
+    for (uint32_t i = 0; i < hj->npieces; i++) {
+        uint32_t piece = hj->piece + i;
+        if (test_hash(tp, hj->hashes[i], piece) == 0)
+            set_bit(cm->piece_field, piece);
+        else
+            clear_bit(cm->piece_field, piece);
+        std->ntested += torrent_piece_size(tp, piece);
+    }
+    if (std->start < tp->npieces)
+        startup_test_run();
+    else if (std->npending == 0) {
+        startup_test_log(std);
         startup_test_end(tp, 1);
-    if (!BTPDQ_EMPTY(&m_startq))
-        btpd_timer_add(&m_workev, (& (struct timespec) { 0, 0 }));
+        if (!BTPDQ_EMPTY(&m_startq))
+            btpd_timer_add(&m_workev, (& (struct timespec) { 0, 0 }));
+    }
+}
+
+static void
+hash_job_done(void *arg)
+{
+    struct hash_job *hj = arg;
+    struct torrent *tp = hj->tp;
+
+    if (cm_job_end(tp)) {
+        if (hj->err != 0) {
+            btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+                hj->errfile, strerror(hj->err));
+            cm_on_error(tp);
+        } else if (hj->startup)
+            startup_test_done(hj);
+        else
+            cm_on_piece_tested(tp, hj->piece,
+                test_hash(tp, hj->hashes[0], hj->piece) == 0);
+    }
+    free(hj->hashes);
+    free(hj);
 }
 
 void
 startup_test_begin(struct torrent *tp, struct file_time_size *fts)
 {
-    uint32_t piece = 0;
     struct content *cm = tp->cm;
-    while (piece < tp->npieces && !has_bit(cm->pos_field, piece))
-        piece++;
+    uint32_t piece = bitset_next(cm->pos_field, tp->npieces, 0);
     if (piece < tp->npieces) {
         struct start_test_data *std = btpd_calloc(1, sizeof(*std));
         std->tp = tp;
@@ -539,5 +1234,8 @@ cm_start(struct torrent *tp, int force_test)
 void
 cm_init(void)
 {
-    evtimer_init(&m_workev, worker_cb, NULL);
+    // Leave room for the peer connections and some more.
+    int maxfds = getdtablesize() - net_max_peers - 32;
+    bts_set_max_fds(max(maxfds, 4));
+    evtimer_init(&m_workev, startup_cb, NULL);
 }
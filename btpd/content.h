@@ -8,6 +8,7 @@ void cm_kill(struct torrent *tp);
 
 void cm_start(struct torrent *tp, int force_test);
 void cm_stop(struct torrent * tp);
+void cm_on_tick(struct torrent *tp);
 
 int cm_active(struct torrent *tp);
 int cm_error(struct torrent *tp);
@@ -26,8 +27,20 @@ int cm_put_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
     const uint8_t *buf, size_t len);
 int cm_get_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
     size_t len, uint8_t **buf);
+int cm_read_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, uint8_t *buf);
+int cm_read_async(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, uint8_t *buf, void (*cb)(void *, int), void *arg);
+void cm_prefetch(struct torrent *tp, uint32_t piece, uint32_t begin);
+int cm_contiguous(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len);
+int cm_get_fd(struct torrent *tp, uint32_t piece, uint32_t begin, int *fd,
+    off_t *off);
+void cm_put_fd(struct torrent *tp, uint32_t piece, uint32_t begin);
 
 void cm_prealloc(struct torrent *tp, uint32_t piece);
 void cm_test_piece(struct torrent *tp, uint32_t piece);
+void cm_test_piece_hash(struct torrent *tp, uint32_t piece,
+    const uint8_t *hash);
 
 #endif
@@ -10,7 +10,7 @@ void
 dl_on_piece_ann(struct peer *p, uint32_t index)
 {
     struct net *n = p->n;
-    n->piece_count[index]++;
+    dl_count_inc(n, index);
     if (cm_has_piece(n->tp, index))
         return;
     struct piece *pc = dl_find_piece(n, index);
@@ -32,6 +32,39 @@ dl_on_piece_ann(struct peer *p, uint32_t index)
     }
 }
 
+/*
+ * Called when a peer has sent its bitfield. Does the work of calling
+ * dl_on_piece_ann for each of the peer's pieces in bulk.
+ */
+void
+dl_on_bitfield(struct peer *p)
+{
+    struct net *n = p->n;
+    uint32_t npieces = n->tp->npieces;
+    const uint8_t *have = cm_get_piece_field(n->tp);
+    uint32_t nwant = 0;
+
+    if (peer_full(p)) {
+        n->nseeds++;
+        p->mp->flags |= PF_SEED_COUNTED;
+    } else {
+        for (uint32_t i = bitset_next(p->piece_field, npieces, 0);
+             i < npieces; i = bitset_next(p->piece_field, npieces, i + 1))
+            dl_count_inc(n, i);
+    }
+
+    for (uint32_t i = bitset_next_andnot(p->piece_field, have, npieces, 0);
+         i < npieces;
+         i = bitset_next_andnot(p->piece_field, have, npieces, i + 1)) {
+        struct piece *pc = n->pcs[i];
+        if (pc == NULL || n->endgame || !piece_full(pc))
+            nwant++;
+    }
+    peer_want_count(p, nwant);
+    if (nwant > 0 && peer_leech_ok(p))
+        dl_on_download(p);
+}
+
 void
 dl_on_download(struct peer *p)
 {
@@ -104,11 +137,11 @@ dl_on_bad_piece(struct net *n, uint32_t piece)
     btpd_log(BTPD_L_ERROR, "Bad hash for piece %u of '%s'.\n",
         pc->index, torrent_name(n->tp));
 
-    for (uint32_t i = 0; i < pc->nblocks; i++)
-        clear_bit(pc->down_field, i);
+    bitset_clear_range(pc->down_field, 0, pc->nblocks);
 
     pc->ngot = 0;
     pc->nbusy = 0;
+    piece_sha_reset(pc);
 
     piece_log_bad(pc);
 
@@ -132,9 +165,16 @@ dl_on_lost_peer(struct peer *p)
 {
     struct net *n = p->n;
 
-    for (uint32_t i = 0; i < n->tp->npieces; i++)
-        if (peer_has(p, i))
-            n->piece_count[i]--;
+    uint32_t npieces = n->tp->npieces;
+    if (p->mp->flags & PF_SEED_COUNTED) {
+        assert(n->nseeds > 0);
+        n->nseeds--;
+        p->mp->flags &= ~PF_SEED_COUNTED;
+    } else {
+        for (uint32_t i = bitset_next(p->piece_field, npieces, 0);
+             i < npieces; i = bitset_next(p->piece_field, npieces, i + 1))
+            dl_count_dec(n, i);
+    }
 
     if (p->nreqs_out > 0)
         dl_on_undownload(p);
@@ -148,43 +188,41 @@ dl_on_block(struct peer *p, struct block_request *req,
     struct piece *pc = dl_find_piece(n, index);
 
     piece_log_block(pc, p, begin);
+    piece_sha_block(pc, begin, data, length);
     cm_put_bytes(p->n->tp, index, begin, data, length);
     pc->ngot++;
 
     if (n->endgame) {
         struct block_request *req, *next;
+        struct block_request_tq *reqs = &pc->reqs[begin / PIECE_BLOCKLEN];
         struct net_buf *cancel = nb_create_cancel(index, begin, length);
         nb_hold(cancel);
-        BTPDQ_FOREACH(req, &pc->reqs, blk_entry) {
-            if (nb_get_begin(req->msg) == begin) {
-                if (req->p != p)
-                    peer_cancel(req->p, req, cancel);
-                pc->nreqs--;
-            }
+        BTPDQ_FOREACH(req, reqs, blk_entry) {
+            if (req->p != p)
+                peer_cancel(req->p, req, cancel);
+            pc->nreqs--;
         }
         nb_drop(cancel);
         dl_piece_reorder_eg(pc);
-        BTPDQ_FOREACH_MUTABLE(req, &pc->reqs, blk_entry, next) {
-            if (nb_get_begin(req->msg) != begin)
-                continue;
-            BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
+        BTPDQ_FOREACH_MUTABLE(req, reqs, blk_entry, next) {
+            BTPDQ_REMOVE(reqs, req, blk_entry);
             nb_drop(req->msg);
             if (peer_leech_ok(req->p))
                 dl_assign_requests_eg(req->p);
-            free(req);
+            dl_free_request(req);
         }
         if (pc->ngot == pc->nblocks)
-            cm_test_piece(pc->n->tp, pc->index);
+            piece_test(pc);
     } else {
-        BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
+        BTPDQ_REMOVE(&pc->reqs[begin / PIECE_BLOCKLEN], req, blk_entry);
         nb_drop(req->msg);
-        free(req);
+        dl_free_request(req);
         pc->nreqs--;
         // XXX: Needs to be looked at if we introduce snubbing.
         clear_bit(pc->down_field, begin / PIECE_BLOCKLEN);
         pc->nbusy--;
         if (pc->ngot == pc->nblocks)
-            cm_test_piece(pc->n->tp, pc->index);
+            piece_test(pc);
         if (peer_leech_ok(p))
             dl_assign_requests(p);
     }
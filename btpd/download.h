@@ -10,10 +10,21 @@ void piece_log_bad(struct piece *pc);
 void piece_log_good(struct piece *pc);
 void piece_log_block(struct piece *pc, struct peer *p, uint32_t begin);
 
+void piece_sha_block(struct piece *pc, uint32_t begin, const uint8_t *data,
+    uint32_t length);
+void piece_sha_reset(struct piece *pc);
+void piece_test(struct piece *pc);
+
 void dl_on_piece_unfull(struct piece *pc);
 
+void dl_on_start(struct net *n);
+void dl_count_inc(struct net *n, uint32_t index);
+void dl_count_dec(struct net *n, uint32_t index);
+
 struct piece *dl_new_piece(struct net *n, uint32_t index);
 struct piece *dl_find_piece(struct net *n, uint32_t index);
+struct block_request *dl_find_request(struct peer *p, uint32_t index,
+    uint32_t begin);
 unsigned dl_piece_assign_requests(struct piece *pc, struct peer *p);
 unsigned  dl_assign_requests(struct peer *p);
 void dl_assign_requests_eg(struct peer *p);
@@ -31,6 +42,8 @@ void dl_on_unchoke(struct peer *p);
 void dl_on_download(struct peer *p);
 void dl_on_undownload(struct peer *p);
 void dl_on_piece_ann(struct peer *p, uint32_t index);
+void dl_on_bitfield(struct peer *p);
+void dl_free_request(struct block_request *req);
 void dl_on_block(struct peer *p, struct block_request *req,
     uint32_t index, uint32_t begin, uint32_t length, const uint8_t *data);
 
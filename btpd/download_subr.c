@@ -24,6 +24,14 @@
 #include <openssl/sha.h>
 #include <stream.h>
 
+// Block logs of pieces with at most this many blocks come from a pool.
+#define BLOG_POOL_BLOCKS 256
+
+static struct pool m_req_pool =
+    POOL_INITIALIZER("block_request", sizeof(struct block_request), 1024);
+static struct pool m_blog_pool = POOL_INITIALIZER("blog_record",
+    sizeof(struct blog_record) + BLOG_POOL_BLOCKS / 8, 256);
+
 static void
 piece_new_log(struct piece *pc)
 {
@@ -53,7 +61,10 @@ piece_log_free(struct piece *pc, struct blog *log)
     struct blog_record *r, *rnext;
     BTPDQ_FOREACH_MUTABLE(r, &log->records, entry, rnext) {
         mp_drop(r->mp, pc->n);
-        free(r);
+        if (pc->nblocks <= BLOG_POOL_BLOCKS)
+            pool_put(&m_blog_pool, r);
+        else
+            free(r);
     }
     if (log->hashes != NULL)
         free(log->hashes);
@@ -142,7 +153,10 @@ piece_log_block(struct piece *pc, struct peer *p, uint32_t begin)
         if (r->mp == p->mp)
             break;
     if (r == NULL) {
-        r = btpd_calloc(1, sizeof(*r) + ceil(pc->nblocks / 8.0));
+        if (pc->nblocks <= BLOG_POOL_BLOCKS)
+            r = pool_calloc(&m_blog_pool);
+        else
+            r = btpd_calloc(1, sizeof(*r) + ceil(pc->nblocks / 8.0));
         r->mp = p->mp;
         mp_hold(r->mp);
         BTPDQ_INSERT_HEAD(&log->records, r, entry);
@@ -153,6 +167,221 @@ piece_log_block(struct piece *pc, struct peer *p, uint32_t begin)
     set_bit(r->down_field, begin / PIECE_BLOCKLEN);
 }
 
+/*
+ * When dl_inline_hash is set each piece keeps a running SHA1 of its
+ * data. Blocks are fed to it in order as they arrive, blocks that arrive
+ * ahead of a gap are kept in memory until the gap is filled. This way
+ * the piece can be verified without reading it back from disk.
+ */
+struct piece_sha {
+    SHA_CTX ctx;
+    uint32_t next;
+    uint8_t *pending[];
+};
+
+static void
+piece_sha_feed(struct piece *pc, const uint8_t *data, uint32_t length)
+{
+    SHA1_Update(&pc->sha->ctx, data, length);
+    pc->sha->next++;
+    while (pc->sha->next < pc->nblocks
+            && pc->sha->pending[pc->sha->next] != NULL) {
+        uint32_t block = pc->sha->next;
+        SHA1_Update(&pc->sha->ctx, pc->sha->pending[block],
+            torrent_block_size(pc->n->tp, pc->index, pc->nblocks, block));
+        free(pc->sha->pending[block]);
+        pc->sha->pending[block] = NULL;
+        pc->sha->next++;
+    }
+}
+
+void
+piece_sha_block(struct piece *pc, uint32_t begin, const uint8_t *data,
+    uint32_t length)
+{
+    uint32_t block = begin / PIECE_BLOCKLEN;
+    if (pc->sha == NULL)
+        return;
+    assert(block >= pc->sha->next && pc->sha->pending[block] == NULL);
+    if (block == pc->sha->next)
+        piece_sha_feed(pc, data, length);
+    else {
+        pc->sha->pending[block] = btpd_malloc(length);
+        bcopy(data, pc->sha->pending[block], length);
+    }
+}
+
+static void
+piece_sha_clear(struct piece *pc)
+{
+    for (uint32_t i = pc->sha->next; i < pc->nblocks; i++)
+        if (pc->sha->pending[i] != NULL) {
+            free(pc->sha->pending[i]);
+            pc->sha->pending[i] = NULL;
+        }
+}
+
+void
+piece_sha_reset(struct piece *pc)
+{
+    if (pc->sha == NULL)
+        return;
+    piece_sha_clear(pc);
+    pc->sha->next = 0;
+    SHA1_Init(&pc->sha->ctx);
+}
+
+/*
+ * Called when all blocks of the piece have been downloaded.
+ */
+void
+piece_test(struct piece *pc)
+{
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    if (pc->sha != NULL && pc->sha->next == pc->nblocks) {
+        SHA1_Final(hash, &pc->sha->ctx);
+        cm_test_piece_hash(pc->n->tp, pc->index, hash);
+    } else
+        cm_test_piece(pc->n->tp, pc->index);
+}
+
+/*
+ * The pieces that could be started on are kept in n->rarity, sorted
+ * by how many peers have them. The pieces seen by c peers start at
+ * n->rbucket[c], and the last entry of n->rbucket is the number of
+ * such pieces. A piece that changes count only has to swap places
+ * with the first or last piece of its bucket.
+ */
+
+#define RARITY_NONE UINT32_MAX
+
+static void
+rarity_move(struct net *n, uint32_t from, uint32_t to)
+{
+    n->rarity[to] = n->rarity[from];
+    n->rpos[n->rarity[to]] = to;
+}
+
+static void
+rarity_swap(struct net *n, uint32_t a, uint32_t b)
+{
+    uint32_t ia = n->rarity[a], ib = n->rarity[b];
+    n->rarity[a] = ib;
+    n->rpos[ib] = a;
+    n->rarity[b] = ia;
+    n->rpos[ia] = b;
+}
+
+// Make room for pieces seen by count peers.
+static void
+rarity_reserve(struct net *n, unsigned count)
+{
+    if (count + 2 <= n->nrbuckets)
+        return;
+    unsigned nbuckets = max(2 * n->nrbuckets, count + 2);
+    uint32_t *rbucket = btpd_calloc(nbuckets, sizeof(*rbucket));
+    uint32_t end = n->rbucket[n->nrbuckets - 1];
+    bcopy(n->rbucket, rbucket, n->nrbuckets * sizeof(*rbucket));
+    for (unsigned c = n->nrbuckets; c < nbuckets; c++)
+        rbucket[c] = end;
+    free(n->rbucket);
+    n->rbucket = rbucket;
+    n->nrbuckets = nbuckets;
+}
+
+static void
+rarity_insert(struct net *n, uint32_t index)
+{
+    unsigned count = n->piece_count[index];
+    rarity_reserve(n, count);
+    uint32_t hole = n->rbucket[n->nrbuckets - 1]++;
+    for (unsigned c = n->nrbuckets - 2; c > count; c--) {
+        uint32_t first = n->rbucket[c];
+        if (first != hole)
+            rarity_move(n, first, hole);
+        n->rbucket[c]++;
+        hole = first;
+    }
+    n->rarity[hole] = index;
+    n->rpos[index] = hole;
+}
+
+static void
+rarity_remove(struct net *n, uint32_t index)
+{
+    unsigned count = n->piece_count[index];
+    uint32_t hole = n->rbucket[count + 1] - 1;
+    rarity_swap(n, n->rpos[index], hole);
+    for (unsigned c = count + 1; c < n->nrbuckets - 1; c++) {
+        uint32_t last = n->rbucket[c + 1] - 1;
+        if (last != hole)
+            rarity_move(n, last, hole);
+        n->rbucket[c]--;
+        hole = last;
+    }
+    n->rbucket[n->nrbuckets - 1]--;
+    n->rpos[index] = RARITY_NONE;
+}
+
+void
+dl_count_inc(struct net *n, uint32_t index)
+{
+    unsigned count = n->piece_count[index];
+    rarity_reserve(n, count + 1);
+    if (n->rpos[index] != RARITY_NONE) {
+        rarity_swap(n, n->rpos[index], n->rbucket[count + 1] - 1);
+        n->rbucket[count + 1]--;
+    }
+    if (count == 0)
+        n->npcs_seen++;
+    n->piece_count[index]++;
+}
+
+void
+dl_count_dec(struct net *n, uint32_t index)
+{
+    unsigned count = n->piece_count[index];
+    assert(count > 0);
+    if (n->rpos[index] != RARITY_NONE) {
+        rarity_swap(n, n->rpos[index], n->rbucket[count]);
+        n->rbucket[count]++;
+    }
+    if (count == 1)
+        n->npcs_seen--;
+    n->piece_count[index]--;
+}
+
+/*
+ * Called when the net is started. Sorts the pieces we're missing
+ * by their counts.
+ */
+void
+dl_on_start(struct net *n)
+{
+    unsigned maxcount = 0;
+    uint32_t npieces = n->tp->npieces;
+    for (uint32_t i = 0; i < npieces; i++)
+        maxcount = max(maxcount, n->piece_count[i]);
+    n->nrbuckets = maxcount + 2;
+    n->rbucket = btpd_calloc(n->nrbuckets, sizeof(*n->rbucket));
+    n->rarity = btpd_calloc(npieces, sizeof(*n->rarity));
+    n->rpos = btpd_calloc(npieces, sizeof(*n->rpos));
+    for (uint32_t i = 0; i < npieces; i++)
+        if (!cm_has_piece(n->tp, i) && !has_bit(n->busy_field, i))
+            n->rbucket[n->piece_count[i] + 1]++;
+    for (unsigned c = 1; c < n->nrbuckets; c++)
+        n->rbucket[c] += n->rbucket[c - 1];
+    uint32_t fill[n->nrbuckets];
+    bcopy(n->rbucket, fill, sizeof(fill));
+    for (uint32_t i = 0; i < npieces; i++) {
+        if (!cm_has_piece(n->tp, i) && !has_bit(n->busy_field, i)) {
+            n->rpos[i] = fill[n->piece_count[i]]++;
+            n->rarity[n->rpos[i]] = i;
+        } else
+            n->rpos[i] = RARITY_NONE;
+    }
+}
+
 static struct piece *
 piece_alloc(struct net *n, uint32_t index)
 {
@@ -164,11 +393,12 @@ piece_alloc(struct net *n, uint32_t index)
 
     nblocks = torrent_piece_blocks(n->tp, index);
     field = (size_t)ceil(nblocks / 8.0);
-    mem = sizeof(*pc) + field;
+    mem = sizeof(*pc) + nblocks * sizeof(*pc->reqs) + field;
 
     pc = btpd_calloc(1, mem);
     pc->n = n;
-    pc->down_field = (uint8_t *)(pc + 1);
+    pc->reqs = (struct block_request_tq *)(pc + 1);
+    pc->down_field = (uint8_t *)(pc->reqs + nblocks);
     pc->have_field = cm_get_block_field(n->tp, index);
 
     pc->index = index;
@@ -177,12 +407,18 @@ piece_alloc(struct net *n, uint32_t index)
     pc->nreqs = 0;
     pc->next_block = 0;
 
-    for (unsigned i = 0; i < nblocks; i++)
-        if (has_bit(pc->have_field, i))
-            pc->ngot++;
+    pc->ngot = bitset_count(pc->have_field, nblocks);
     assert(pc->ngot < pc->nblocks);
 
-    BTPDQ_INIT(&pc->reqs);
+    // Blocks already on disk would have to be read back anyway.
+    if (dl_inline_hash && pc->ngot == 0) {
+        pc->sha = btpd_calloc(1,
+            sizeof(*pc->sha) + nblocks * sizeof(pc->sha->pending[0]));
+        SHA1_Init(&pc->sha->ctx);
+    }
+
+    for (unsigned i = 0; i < nblocks; i++)
+        BTPDQ_INIT(&pc->reqs[i]);
     BTPDQ_INIT(&pc->logs);
 
     piece_new_log(pc);
@@ -190,6 +426,8 @@ piece_alloc(struct net *n, uint32_t index)
     n->npcs_busy++;
     set_bit(n->busy_field, index);
     BTPDQ_INSERT_TAIL(&n->getlst, pc, entry);
+    n->pcs[index] = pc;
+    rarity_remove(n, index);
     return pc;
 }
 
@@ -202,9 +440,14 @@ piece_free(struct piece *pc)
     n->npcs_busy--;
     clear_bit(n->busy_field, pc->index);
     BTPDQ_REMOVE(&pc->n->getlst, pc, entry);
-    BTPDQ_FOREACH_MUTABLE(req, &pc->reqs, blk_entry, next) {
-        nb_drop(req->msg);
-        free(req);
+    n->pcs[pc->index] = NULL;
+    if (!cm_has_piece(n->tp, pc->index))
+        rarity_insert(n, pc->index);
+    for (unsigned i = 0; i < pc->nblocks; i++) {
+        BTPDQ_FOREACH_MUTABLE(req, &pc->reqs[i], blk_entry, next) {
+            nb_drop(req->msg);
+            dl_free_request(req);
+        }
     }
     piece_kill_logs(pc);
     if (pc->eg_reqs != NULL) {
@@ -213,6 +456,10 @@ piece_free(struct piece *pc)
                 nb_drop(pc->eg_reqs[i]);
         free(pc->eg_reqs);
     }
+    if (pc->sha != NULL) {
+        piece_sha_clear(pc);
+        free(pc->sha);
+    }
     free(pc);
 }
 
@@ -281,15 +528,13 @@ dl_enter_endgame(struct net *n)
 
     pi = 0;
     BTPDQ_FOREACH(pc, &n->getlst, entry) {
-        struct block_request *req;
-        for (unsigned i = 0; i < pc->nblocks; i++)
-            clear_bit(pc->down_field, i);
+        bitset_clear_range(pc->down_field, 0, pc->nblocks);
         pc->nbusy = 0;
         pc->eg_reqs = btpd_calloc(pc->nblocks, sizeof(struct net_buf *));
-        BTPDQ_FOREACH(req, &pc->reqs, blk_entry) {
-            uint32_t blki = nb_get_begin(req->msg) / PIECE_BLOCKLEN;
-            if (pc->eg_reqs[blki] == NULL) {
-                pc->eg_reqs[blki] = req->msg;
+        for (unsigned i = 0; i < pc->nblocks; i++) {
+            struct block_request *req = BTPDQ_FIRST(&pc->reqs[i]);
+            if (req != NULL) {
+                pc->eg_reqs[i] = req->msg;
                 nb_hold(req->msg);
             }
         }
@@ -313,65 +558,64 @@ dl_enter_endgame(struct net *n)
 struct piece *
 dl_find_piece(struct net *n, uint32_t index)
 {
-    struct piece *pc;
-    BTPDQ_FOREACH(pc, &n->getlst, entry)
-        if (pc->index == index)
-            break;
-    return pc;
+    return n->pcs[index];
 }
 
-static int
-dl_piece_startable(struct peer *p, uint32_t index)
+/*
+ * Find the peer's outstanding request for the block at begin in
+ * the given piece. Returns NULL if there's no such request.
+ */
+struct block_request *
+dl_find_request(struct peer *p, uint32_t index, uint32_t begin)
 {
-    return peer_requestable(p, index) && !cm_has_piece(p->n->tp, index)
-        && !has_bit(p->n->busy_field, index);
+    struct piece *pc;
+    struct block_request *req;
+    uint32_t blki = begin / PIECE_BLOCKLEN;
+    if (index >= p->n->tp->npieces || (pc = p->n->pcs[index]) == NULL
+        || begin % PIECE_BLOCKLEN != 0 || blki >= pc->nblocks)
+        return NULL;
+    BTPDQ_FOREACH(req, &pc->reqs[blki], blk_entry)
+        if (req->p == p)
+            return req;
+    return NULL;
 }
 
 /*
  * Find the rarest piece the peer has, that isn't already allocated
  * for download or already downloaded. If no such piece can be found
- * return ENOENT.
+ * return ENOENT. Ties are broken at random. Only the pieces we could
+ * start on are kept in n->rarity, so the peer just has to have them.
  *
  * Return 0 or ENOENT, index in res.
  */
 static int
 dl_choose_rarest(struct peer *p, uint32_t *res)
 {
-    uint32_t i;
     struct net *n = p->n;
 
     assert(n->endgame == 0);
 
-    for (i = 0; i < n->tp->npieces && !dl_piece_startable(p, i); i++)
-        ;
-
-    if (i == n->tp->npieces)
-        return ENOENT;
-
-    uint32_t min_i = i;
-    uint32_t min_c = 1;
-    for(i++; i < n->tp->npieces; i++) {
-        if (dl_piece_startable(p, i)) {
-            if (n->piece_count[i] == n->piece_count[min_i])
-                min_c++;
-            else if (n->piece_count[i] < n->piece_count[min_i]) {
-                min_i = i;
-                min_c = 1;
-            }
+    // The pieces in the first bucket are only available from seeds.
+    unsigned c = (p->mp->flags & PF_SEED_COUNTED) ? 0 : 1;
+    for (; c < n->nrbuckets - 1; c++) {
+        uint32_t start = n->rbucket[c], end = n->rbucket[c + 1];
+        if (start == end)
+            continue;
+        if (peer_full(p) && p->npcs_bad == 0) {
+            *res = n->rarity[start + random() % (end - start)];
+            assert(peer_requestable(p, *res));
+            return 0;
         }
-    }
-    if (min_c > 1) {
-        min_c = rand_between(1, min_c);
-        for (i = min_i; min_c > 0; i++) {
-            if (dl_piece_startable(p, i)
-                && n->piece_count[i] == n->piece_count[min_i]) {
-                min_c--;
-                min_i = i;
-            }
+        unsigned found = 0;
+        for (uint32_t j = start; j < end; j++) {
+            uint32_t i = n->rarity[j];
+            if (peer_requestable(p, i) && random() % ++found == 0)
+                *res = i;
         }
+        if (found > 0)
+            return 0;
     }
-    *res = min_i;
-    return 0;
+    return ENOENT;
 }
 
 /*
@@ -423,21 +667,29 @@ dl_on_piece_unfull(struct piece *pc)
 #define INCNEXTBLOCK(pc) \
     (pc)->next_block = ((pc)->next_block + 1) % (pc)->nblocks
 
+void
+dl_free_request(struct block_request *req)
+{
+    pool_put(&m_req_pool, req);
+}
+
 static struct block_request *
 dl_new_request(struct peer *p, struct piece *pc, struct net_buf *msg)
 {
-    if (msg == NULL) {
-        uint32_t block = pc->next_block;
-        uint32_t start = block * PIECE_BLOCKLEN;
-        uint32_t length =
-            torrent_block_size(pc->n->tp, pc->index, pc->nblocks, block);
+    uint32_t block = pc->next_block;
+    uint32_t start = block * PIECE_BLOCKLEN;
+    uint32_t length =
+        torrent_block_size(pc->n->tp, pc->index, pc->nblocks, block);
+    if (msg == NULL)
         msg = nb_create_request(pc->index, start, length);
-    }
-    struct block_request *req = btpd_malloc(sizeof(*req));
+    struct block_request *req = pool_get(&m_req_pool);
     req->p = p;
     req->msg = msg;
+    req->index = pc->index;
+    req->begin = start;
+    req->length = length;
     nb_hold(req->msg);
-    BTPDQ_INSERT_TAIL(&pc->reqs, req, blk_entry);
+    BTPDQ_INSERT_TAIL(&pc->reqs[block], req, blk_entry);
     pc->nreqs++;
     if (!pc->n->endgame) {
         set_bit(pc->down_field, pc->next_block);
@@ -503,7 +755,7 @@ dl_assign_requests(struct peer *p)
             break;
     }
     while (!peer_laden(p) && !n->endgame) {
-        uint32_t index;
+        uint32_t index = 0;
         if (dl_choose_rarest(p, &index) == 0) {
             pc = dl_new_piece(n, index);
             if (pc != NULL)
@@ -519,25 +771,26 @@ dl_unassign_requests(struct peer *p)
 {
     while (p->nreqs_out > 0) {
         struct block_request *req = BTPDQ_FIRST(&p->my_reqs);
-        struct piece *pc = dl_find_piece(p->n, nb_get_index(req->msg));
+        struct piece *pc = dl_find_piece(p->n, req->index);
         int was_full = piece_full(pc);
 
         while (req != NULL) {
             struct block_request *next = BTPDQ_NEXT(req, p_entry);
 
-            uint32_t blki = nb_get_begin(req->msg) / PIECE_BLOCKLEN;
+            uint32_t blki = req->begin / PIECE_BLOCKLEN;
             // XXX: Needs to be looked at if we introduce snubbing.
             assert(has_bit(pc->down_field, blki));
             clear_bit(pc->down_field, blki);
             pc->nbusy--;
             BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
             p->nreqs_out--;
-            BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
+            BTPDQ_REMOVE(&pc->reqs[req->begin / PIECE_BLOCKLEN], req,
+                blk_entry);
             nb_drop(req->msg);
-            free(req);
+            dl_free_request(req);
             pc->nreqs--;
 
-            while (next != NULL && nb_get_index(next->msg) != pc->index)
+            while (next != NULL && next->index != pc->index)
                 next = BTPDQ_NEXT(next, p_entry);
             req = next;
         }
@@ -609,7 +862,7 @@ dl_unassign_requests_eg(struct peer *p)
     while (p->nreqs_out > 0) {
         req = BTPDQ_FIRST(&p->my_reqs);
 
-        pc = dl_find_piece(p->n, nb_get_index(req->msg));
+        pc = dl_find_piece(p->n, req->index);
         BTPDQ_REMOVE(&pc->n->getlst, pc, entry);
         BTPDQ_INSERT_HEAD(&tmp, pc, entry);
 
@@ -617,12 +870,13 @@ dl_unassign_requests_eg(struct peer *p)
             struct block_request *next = BTPDQ_NEXT(req, p_entry);
             BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
             p->nreqs_out--;
-            BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
+            BTPDQ_REMOVE(&pc->reqs[req->begin / PIECE_BLOCKLEN], req,
+                blk_entry);
             nb_drop(req->msg);
-            free(req);
+            dl_free_request(req);
             pc->nreqs--;
 
-            while (next != NULL && nb_get_index(next->msg) != pc->index)
+            while (next != NULL && next->index != pc->index)
                 next = BTPDQ_NEXT(next, p_entry);
             req = next;
         }
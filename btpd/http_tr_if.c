@@ -4,30 +4,51 @@
 #include <iobuf.h>
 
 #define MAX_DOWNLOAD (1 << 18)  // 256kB
+#define MAX_CONNS 2             // Connections per tracker.
+#define MAX_PIPELINE 8          // Requests in flight per connection.
+#define REQ_TIMEOUT (& (struct timespec) { 60, 0 })
+#define CONN_TIMEOUT (& (struct timespec) { 30, 0 })
+#define CONN_IDLE (& (struct timespec) { 15, 0 })
 
 static const char *m_tr_events[] = { "started", "stopped", "completed", "" };
 
+/*
+ * A connection to a tracker, shared by the requests to its host and
+ * port. It's kept open for a while after its last response, so that the
+ * announces of many torrents on one tracker don't need one each.
+ */
+struct httptr_conn {
+    char *host;
+    uint16_t port;
+    struct http_conn *hc;
+    nameconn_t nc;
+    int sd;
+    struct fdev ioev;
+    struct timeout timer;
+    BTPDQ_ENTRY(httptr_conn) entry;
+};
+
+BTPDQ_HEAD(httptr_conn_tq, httptr_conn);
+
+static struct httptr_conn_tq m_conns = BTPDQ_HEAD_INITIALIZER(m_conns);
+
 struct httptr_req {
     struct torrent *tp;
     struct tr_tier *tr;
     struct http_req *req;
     struct iobuf buf;
-    struct fdev ioev;
     struct timeout timer;
-    nameconn_t nc;
-    int sd;
+    char *url;
+    int retried;
     enum tr_event event;
 };
 
 static void
 httptr_free(struct httptr_req *treq)
 {
-    if (treq->sd != -1) {
-        btpd_ev_del(&treq->ioev);
-        close(treq->sd);
-    }
     btpd_timer_del(&treq->timer);
     iobuf_free(&treq->buf);
+    free(treq->url);
     free(treq);
 }
 
@@ -118,6 +139,135 @@ bad_data:
     res->type = TR_RES_BAD;
 }
 
+static void
+conn_kill(struct httptr_conn *c)
+{
+    BTPDQ_REMOVE(&m_conns, c, entry);
+    if (c->nc != NULL)
+        btpd_name_connect_cancel(c->nc);
+    if (c->sd != -1) {
+        btpd_ev_del(&c->ioev);
+        close(c->sd);
+    }
+    btpd_timer_del(&c->timer);
+    http_conn_free(c->hc);
+    free(c->host);
+    free(c);
+}
+
+/*
+ * A connection with requests must make progress and one without must be
+ * used again soon, or it's closed.
+ */
+static void
+conn_arm(struct httptr_conn *c)
+{
+    btpd_timer_add(&c->timer,
+        http_conn_nreqs(c->hc) > 0 ? CONN_TIMEOUT : CONN_IDLE);
+}
+
+static void
+conn_io_cb(int sd, short type, void *arg)
+{
+    struct httptr_conn *c = arg;
+    switch (type) {
+    case EV_READ:
+        if (!http_conn_read(c->hc, sd)) {
+            conn_kill(c);
+            return;
+        }
+        break;
+    case EV_WRITE:
+        if (!http_conn_write(c->hc, sd)) {
+            conn_kill(c);
+            return;
+        }
+        if (!http_conn_want_write(c->hc))
+            btpd_ev_disable(&c->ioev, EV_WRITE);
+        break;
+    case EV_TIMEOUT:
+        conn_kill(c);
+        return;
+    default:
+        abort();
+    }
+    conn_arm(c);
+}
+
+static void
+conn_nc_cb(void *arg, int error, int sd)
+{
+    struct httptr_conn *c = arg;
+    c->nc = NULL;
+    if (error)
+        conn_kill(c);
+    else {
+        c->sd = sd;
+        btpd_ev_new(&c->ioev, sd,
+            EV_READ | (http_conn_want_write(c->hc) ? EV_WRITE : 0),
+            conn_io_cb, c);
+        conn_arm(c);
+    }
+}
+
+/*
+ * Returns the connection to send the next request to the tracker on.
+ * That's the least busy of the open ones, unless it's busy enough to
+ * warrant another connection and there's room for one.
+ */
+static struct httptr_conn *
+conn_get(const char *host, uint16_t port)
+{
+    struct httptr_conn *c, *best = NULL;
+    unsigned nconns = 0;
+    BTPDQ_FOREACH(c, &m_conns, entry) {
+        if (c->port != port || strcmp(c->host, host) != 0
+                || !http_conn_alive(c->hc))
+            continue;
+        nconns++;
+        if (best == NULL
+                || http_conn_nreqs(c->hc) < http_conn_nreqs(best->hc))
+            best = c;
+    }
+    if (best != NULL && (http_conn_nreqs(best->hc) < MAX_PIPELINE
+            || nconns >= MAX_CONNS))
+        return best;
+
+    c = btpd_calloc(1, sizeof(*c));
+    if ((c->host = strdup(host)) == NULL || (c->hc = http_conn_new()) == NULL)
+        btpd_err("Out of memory.\n");
+    c->port = port;
+    c->sd = -1;
+    evtimer_init(&c->timer, conn_io_cb, c);
+    btpd_timer_add(&c->timer, CONN_TIMEOUT);
+    BTPDQ_INSERT_TAIL(&m_conns, c, entry);
+    c->nc = btpd_name_connect(host, port, conn_nc_cb, c);
+    return c;
+}
+
+static void http_cb(struct http_req *req, struct http_response *res,
+    void *arg);
+
+static int
+httptr_send(struct httptr_req *treq)
+{
+    struct http_url *url;
+    struct httptr_conn *c;
+    if (!http_get(&treq->req, treq->url, "User-Agent: " BTPD_VERSION "\r\n",
+            http_cb, treq))
+        return 0;
+    url = http_url_get(treq->req);
+    c = conn_get(url->host, url->port);
+    if (!http_conn_add(c->hc, treq->req))
+        btpd_err("Out of memory.\n");
+    if (c->sd != -1) {
+        btpd_ev_enable(&c->ioev, EV_WRITE);
+        if (http_conn_nreqs(c->hc) == 1)
+            conn_arm(c);
+    }
+    return 1;
+}
+
 static void
 http_cb(struct http_req *req, struct http_response *res, void *arg)
 {
@@ -125,7 +275,14 @@ http_cb(struct http_req *req, struct http_response *res, void *arg)
     struct tr_response tres = {0, NULL, -1 };
     switch (res->type) {
     case HTTP_T_ERR:
-        tres.type = TR_RES_BAD;
+        // The tracker may close a kept alive connection just as we send
+        // on it, so the request gets another try on a new connection.
+        if (res->v.error == HTTP_E_CLOSED && !treq->retried) {
+            treq->retried = 1;
+            if (httptr_send(treq))
+                break;
+        }
+        tres.type = res->v.error == HTTP_E_BAD ? TR_RES_BAD : TR_RES_CONN;
         tr_result(treq->tr, &tres);
         httptr_free(treq);
         break;
@@ -155,47 +312,13 @@ http_cb(struct http_req *req, struct http_response *res, void *arg)
 }
 
 static void
-httptr_io_cb(int sd, short type, void *arg)
-{
-    struct tr_response res;
-    struct httptr_req *treq = arg;
-    switch (type) {
-    case EV_READ:
-        if (http_read(treq->req, sd) && !http_want_read(treq->req))
-            btpd_ev_disable(&treq->ioev, EV_READ);
-        break;
-    case EV_WRITE:
-        if (http_write(treq->req, sd) && !http_want_write(treq->req))
-            btpd_ev_disable(&treq->ioev, EV_WRITE);
-        break;
-    case EV_TIMEOUT:
-        res.type = TR_RES_CONN;
-        tr_result(treq->tr, &res);
-        httptr_cancel(treq);
-        break;
-    default:
-        abort();
-    }
-}
-
-static void
-httptr_nc_cb(void *arg, int error, int sd)
+httptr_timer_cb(int sd, short type, void *arg)
 {
     struct tr_response res;
     struct httptr_req *treq = arg;
-    if (error) {
-        res.type = TR_RES_CONN;
-        tr_result(treq->tr, &res);
-        http_cancel(treq->req);
-        httptr_free(treq);
-    } else {
-        treq->sd = sd;
-        uint16_t flags =
-            (http_want_read(treq->req) ? EV_READ : 0) |
-            (http_want_write(treq->req) ? EV_WRITE : 0);
-        btpd_ev_new(&treq->ioev, sd, flags, httptr_io_cb, treq);
-        btpd_timer_add(&treq->timer, (& (struct timespec) { 30, 0 }));
-    }
+    res.type = TR_RES_CONN;
+    tr_result(treq->tr, &res);
+    httptr_cancel(treq);
 }
 
 struct httptr_req *
@@ -204,7 +327,6 @@ httptr_req(struct torrent *tp, struct tr_tier *tr, const char *aurl,
 {
     char e_hash[61], e_id[61], url[512], qc;
     const uint8_t *peer_id = btpd_get_peer_id();
-    struct http_url *http_url;
 
     qc = (strchr(aurl, '?') == NULL) ? '?' : '&';
 
@@ -223,32 +345,26 @@ httptr_req(struct torrent *tp, struct tr_tier *tr, const char *aurl,
         event == TR_EV_EMPTY ? "" : "&event=", m_tr_events[event]);
 
     struct httptr_req *treq = btpd_calloc(1, sizeof(*treq));
-    if (!http_get(&treq->req, url, "User-Agent: " BTPD_VERSION "\r\n",
-            http_cb, treq)) {
-        free(treq);
-        return NULL;
-    }
+    evtimer_init(&treq->timer, httptr_timer_cb, treq);
+    if ((treq->url = strdup(url)) == NULL)
+        btpd_err("Out of memory.\n");
     treq->tp = tp;
     treq->tr = tr;
     treq->event = event;
     treq->buf = iobuf_init(4096);
     if (treq->buf.error)
         btpd_err("Out of memory.\n");
-    treq->tr = tr;
-    treq->sd = -1;
-    http_url = http_url_get(treq->req);
-    treq->nc = btpd_name_connect(http_url->host, http_url->port,
-        httptr_nc_cb, treq);
-    evtimer_init(&treq->timer, httptr_io_cb, treq);
-    btpd_timer_add(&treq->timer, (& (struct timespec) { 60, 0 }));
+    if (!httptr_send(treq)) {
+        httptr_free(treq);
+        return NULL;
+    }
+    btpd_timer_add(&treq->timer, REQ_TIMEOUT);
     return treq;
 }
 
 void
 httptr_cancel(struct httptr_req *treq)
 {
-    if (treq->sd == -1)
-        btpd_name_connect_cancel(treq->nc);
     http_cancel(treq->req);
     httptr_free(treq);
 }
@@ -130,6 +130,17 @@ usage(void)
         "\tLet the tracker distribute the given address instead of the one\n"
         "\tit sees btpd connect from.\n"
         "\n"
+        "--cache-size n\n"
+        "\tKeep at most n kB of recently uploaded data in memory.\n"
+        "\tDefault is 4096. If n is zero no data will be cached.\n"
+        "\n"
+        "--inline-hash\n"
+        "\tHash pieces in memory as their blocks arrive, instead of reading\n"
+        "\tthem back from disk when they are complete.\n"
+        "\n"
+        "--io-threads n\n"
+        "\tUse n threads for verifying piece data. Default is 2.\n"
+        "\n"
         "--ipcprot mode\n"
         "\tSet the protection mode of the command socket.\n"
         "\tThe mode is specified by an octal number. Default is 0600.\n"
@@ -140,6 +151,15 @@ usage(void)
         "--max-peers n\n"
         "\tLimit the amount of peers to n.\n"
         "\n"
+        "--min-requests n\n"
+        "\tKeep at least n block requests outstanding to a peer we're\n"
+        "\tdownloading from. Default is 10.\n"
+        "\n"
+        "--max-requests n\n"
+        "\tKeep at most n block requests outstanding to a peer. Between the\n"
+        "\ttwo limits the number follows the peer's download rate and\n"
+        "\tround trip time. Default and most allowed is 127.\n"
+        "\n"
         "--max-uploads n\n"
         "\tControls the number of simultaneous uploads.\n"
         "\tThe possible values are:\n"
@@ -160,6 +180,24 @@ usage(void)
         "\tNote that n will be rounded up to the closest multiple of the\n"
         "\ttorrent piece size. If n is zero no preallocation will be done.\n"
         "\n"
+        "--write-buffer n\n"
+        "\tCollect up to n kB of downloaded data in memory, so that it can\n"
+        "\tbe written in large chunks. Default is 16384.\n"
+        "\n"
+        "--rate-window n\n"
+        "\tReport transfer rates averaged over the last n seconds, where\n"
+        "\tn is at most 60. Default is 10.\n"
+        "\n"
+        "--seed-choker mode\n"
+        "\tHow to choose the peers to upload to in torrents we seed.\n"
+        "\t'fastest' prefers the peers we upload the fastest to and\n"
+        "\t'round-robin' takes turns by the amount of data sent to each.\n"
+        "\tThe default is fastest. btcli can set it for each torrent.\n"
+        "\n"
+        "--sendfile\n"
+        "\tSend torrent data to peers directly from the files with\n"
+        "\tsendfile(2). Only available on Linux.\n"
+        "\n"
         "--numwant n\n"
         "\tSet the number of peers to fetch on each request. Default is 50.\n"
         "\n");
@@ -182,6 +220,15 @@ static struct option longopts[] = {
     { "ip", required_argument,          &longval,       10 },
     { "logmask", required_argument,     &longval,       11 },
     { "numwant", required_argument,     &longval,       12 },
+    { "io-threads", required_argument,  &longval,       13 },
+    { "inline-hash", no_argument,       &longval,       14 },
+    { "cache-size", required_argument,  &longval,       15 },
+    { "sendfile", no_argument,          &longval,       16 },
+    { "write-buffer", required_argument, &longval,      17 },
+    { "min-requests", required_argument, &longval,      18 },
+    { "max-requests", required_argument, &longval,      19 },
+    { "rate-window", required_argument, &longval,       20 },
+    { "seed-choker", required_argument, &longval,       21 },
     { "help",   no_argument,            &longval,       128 },
     { NULL,     0,                      NULL,           0 }
 };
@@ -190,7 +237,7 @@ int
 main(int argc, char **argv)
 {
     char *dir = NULL, *log = NULL;
-    int daemonize = 1, opt4 = 0, opt6 = 0;
+    int daemonize = 1, opt4 = 0, opt6 = 0, reqs;
 
     for (;;) {
         switch (getopt_long(argc, argv, "46d:p:", longopts, NULL)) {
@@ -246,6 +293,47 @@ main(int argc, char **argv)
             case 12:
                 net_numwant = (unsigned)atoi(optarg);
                 break;
+            case 13:
+                if ((wk_nthreads = atoi(optarg)) < 1)
+                    usage();
+                break;
+            case 14:
+                dl_inline_hash = 1;
+                break;
+            case 15:
+                cache_size = (size_t)atoi(optarg) * 1024;
+                break;
+            case 16:
+                net_sendfile = 1;
+                break;
+            case 17:
+                cm_wbuf_size = (size_t)atoi(optarg) * 1024;
+                break;
+            case 18:
+                reqs = atoi(optarg);
+                if (reqs < 1 || reqs > MAXREQS)
+                    usage();
+                net_min_reqs = reqs;
+                break;
+            case 19:
+                reqs = atoi(optarg);
+                if (reqs < 1 || reqs > MAXREQS)
+                    usage();
+                net_max_reqs = reqs;
+                break;
+            case 20:
+                ipc_rate_window = atoi(optarg);
+                if (ipc_rate_window < 1 || ipc_rate_window > RATE_SECS)
+                    usage();
+                break;
+            case 21:
+                if (strcmp(optarg, "fastest") == 0)
+                    net_seed_choker = IPC_CHOKER_FASTEST;
+                else if (strcmp(optarg, "round-robin") == 0)
+                    net_seed_choker = IPC_CHOKER_ROUNDROBIN;
+                else
+                    usage();
+                break;
             default:
                 usage();
             }
@@ -256,6 +344,8 @@ main(int argc, char **argv)
         }
     }
 args_done:
+    if (net_max_reqs < net_min_reqs)
+        usage();
     argc -= optind;
     argv += optind;
 
@@ -16,7 +16,7 @@ static void
 nc_free(struct nameconn *nc)
 {
     if (nc->ai_res != NULL)
-        freeaddrinfo(nc->ai_res);
+        btpd_addrinfo_free(nc->ai_res);
     free(nc);
 }
 
@@ -3,15 +3,26 @@
 #include <sys/uio.h>
 #include <netdb.h>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #ifndef IOV_MAX
 #define IOV_MAX 1024
 #endif
 
-static unsigned long m_bw_bytes_in;
-static unsigned long m_bw_bytes_out;
+#define BW_HZ 10            // Bandwidth bucket refills per second.
+#define BW_MIN_SHARE 1024   // Smallest share of a tick given to a peer.
 
-static unsigned long m_rate_up;
-static unsigned long m_rate_dwn;
+enum bw_dir { BW_IN, BW_OUT };
+
+// Bytes left in this tick's global download and upload buckets.
+static unsigned long m_bw_bytes[2];
+static unsigned m_bw_ticks;
+static struct timeout m_bw_timer;
+// The waiting unattached peers and the sum of waiting torrents' weights.
+static unsigned m_bw_nwait;
+static unsigned long m_bw_weight;
 
 struct net_listener {
     int sd;
@@ -57,6 +68,7 @@ net_create(struct torrent *tp)
 
     n->busy_field = btpd_calloc(ceil(tp->npieces / 8.0), 1);
     n->piece_count = btpd_calloc(tp->npieces, sizeof(*n->piece_count));
+    n->pcs = btpd_calloc(tp->npieces, sizeof(*n->pcs));
 }
 
 void
@@ -72,6 +84,10 @@ net_kill(struct torrent *tp)
     mptbl_free(tp->net->mptbl);
     free(tp->net->piece_count);
     free(tp->net->busy_field);
+    free(tp->net->pcs);
+    free(tp->net->rarity);
+    free(tp->net->rpos);
+    free(tp->net->rbucket);
     free(tp->net);
     tp->net = NULL;
 }
@@ -81,6 +97,7 @@ net_start(struct torrent *tp)
 {
     struct net *n = tp->net;
     n->active = 1;
+    dl_on_start(n);
 }
 
 void
@@ -89,8 +106,8 @@ net_stop(struct torrent *tp)
     struct net *n = tp->net;
 
     n->active = 0;
-    n->rate_up = 0;
-    n->rate_dwn = 0;
+    rate_clear(&n->rate_up);
+    rate_clear(&n->rate_dwn);
 
     ul_on_lost_torrent(n);
 
@@ -123,10 +140,64 @@ net_active(struct torrent *tp)
 
 #define BLOCK_MEM_COUNT 1
 
+struct td_read {
+    struct meta_peer *mp;
+    struct net *n;
+};
+
+static void
+net_td_read_cb(void *arg, int err)
+{
+    struct td_read *tr = arg;
+    struct peer *p = tr->mp->p;
+    if (p != NULL) {
+        p->mp->flags &= ~PF_READING;
+        if (err != 0)
+            peer_kill(p);
+        else if (!outq_empty(&p->outq) && !(p->mp->flags & PF_ON_WRITEQ))
+            btpd_ev_enable(&p->ioev, EV_WRITE);
+    }
+    mp_drop(tr->mp, tr->n);
+    free(tr);
+}
+
+/*
+ * Returns EAGAIN if the peer has to wait for the data to be read.
+ */
+static int
+net_td_fill(struct peer *p, struct net_buf *tdata, uint32_t index,
+    uint32_t begin, uint32_t length)
+{
+    int err;
+    struct td_read *tr = btpd_calloc(1, sizeof(*tr));
+    tr->mp = p->mp;
+    tr->n = p->n;
+    err = nb_torrentdata_fill(tdata, p->n->tp, index, begin, length,
+        net_td_read_cb, tr);
+    if (err == EAGAIN) {
+        mp_hold(p->mp);
+        p->mp->flags |= PF_READING;
+    } else
+        free(tr);
+    return err;
+}
+
+static void
+net_count_up(struct peer *p, unsigned long bytes)
+{
+    p->n->uploaded += bytes;
+    p->uploaded += bytes;
+    rate_add(&p->rate_up, bytes);
+    rate_add(&p->n->rate_up, bytes);
+    ul_on_upload(p, bytes);
+}
+
 static unsigned long
 net_write(struct peer *p, unsigned long wmax)
 {
-    struct nb_link *nl;
+    struct outq *q = &p->outq;
+    struct net_buf *nb;
+    unsigned seq;
     struct iovec iov[IOV_MAX];
     int niov;
     int limited;
@@ -137,18 +208,55 @@ net_write(struct peer *p, unsigned long wmax)
     limited = wmax > 0;
 
     niov = 0;
-    assert((nl = BTPDQ_FIRST(&p->outq)) != NULL);
-    if (nl->nb->type == NB_TORRENTDATA)
+    assert(!outq_empty(q));
+    nb = outq_first(q);
+#ifdef __linux__
+    if (nb->type == NB_TORRENTDATA && nb->buf == NULL) {
+        // The data is sent straight from its file.
+        int fd;
+        off_t off;
+        size_t len = nb->len - q->off;
+        if (limited && len > wmax)
+            len = wmax;
+        if (cm_get_fd(p->n->tp, p->td_index, p->td_begin + q->off,
+                &fd, &off) != 0) {
+            peer_kill(p);
+            return 0;
+        }
+        nwritten = sendfile(p->sd, fd, &off, len);
+        cm_put_fd(p->n->tp, p->td_index, p->td_begin + q->off);
+        goto written;
+    }
+#endif
+    if (nb->type == NB_TORRENTDATA)
         block_count = 1;
-    while ((niov < IOV_MAX && nl != NULL
+    seq = q->head;
+    while ((niov < IOV_MAX && seq != q->tail
                && (!limited || (limited && wmax > 0)))) {
-        if (nl->nb->type == NB_PIECE) {
+        int last = 0;
+        nb = outq_at(q, seq);
+        if (nb->type == NB_PIECE) {
             if (block_count >= BLOCK_MEM_COUNT)
                 break;
-            struct net_buf *tdata = BTPDQ_NEXT(nl, entry)->nb;
-            if (tdata->buf == NULL) {
-                if (nb_torrentdata_fill(tdata, p->n->tp, nb_get_index(nl->nb),
-                        nb_get_begin(nl->nb), nb_get_length(nl->nb)) != 0) {
+            struct net_buf *tdata = outq_at(q, seq + 1);
+            uint32_t index = nb_get_index(nb);
+            uint32_t begin = nb_get_begin(nb);
+            uint32_t length = nb_get_length(nb);
+#ifdef __linux__
+            if (net_sendfile && tdata->buf == NULL && tdata->len == 0
+                    && cm_contiguous(p->n->tp, index, begin, length))
+                tdata->len = length;
+#endif
+            if (tdata->buf == NULL && tdata->len > 0)
+                last = 1;
+            else if (tdata->buf == NULL) {
+                int err;
+                if (p->mp->flags & PF_READING)
+                    break;
+                if ((err = net_td_fill(p, tdata, index, begin,
+                         length)) == EAGAIN)
+                    break;
+                else if (err != 0) {
                     peer_kill(p);
                     return 0;
                 }
@@ -156,11 +264,11 @@ net_write(struct peer *p, unsigned long wmax)
             block_count++;
         }
         if (niov > 0) {
-            iov[niov].iov_base = nl->nb->buf;
-            iov[niov].iov_len = nl->nb->len;
+            iov[niov].iov_base = nb->buf;
+            iov[niov].iov_len = nb->len;
         } else {
-            iov[niov].iov_base = nl->nb->buf + p->outq_off;
-            iov[niov].iov_len = nl->nb->len - p->outq_off;
+            iov[niov].iov_base = nb->buf + q->off;
+            iov[niov].iov_len = nb->len - q->off;
         }
         if (limited) {
             if (iov[niov].iov_len > wmax)
@@ -168,10 +276,21 @@ net_write(struct peer *p, unsigned long wmax)
             wmax -= iov[niov].iov_len;
         }
         niov++;
-        nl = BTPDQ_NEXT(nl, entry);
+        seq = outq_next(q, seq);
+        if (last)
+            break;
+    }
+
+    if (niov == 0) {
+        // Wait for the data to be read.
+        btpd_ev_disable(&p->ioev, EV_WRITE);
+        return 0;
     }
 
     nwritten = writev(p->sd, iov, niov);
+#ifdef __linux__
+written:
+#endif
     if (nwritten < 0) {
         if (errno == EAGAIN) {
             p->t_wantwrite = btpd_seconds;
@@ -189,31 +308,28 @@ net_write(struct peer *p, unsigned long wmax)
 
     bcount = nwritten;
 
-    nl = BTPDQ_FIRST(&p->outq);
     while (bcount > 0) {
-        unsigned long bufdelta = nl->nb->len - p->outq_off;
+        nb = outq_first(q);
+        unsigned long bufdelta = nb->len - q->off;
         if (bcount >= bufdelta) {
-            peer_sent(p, nl->nb);
-            if (nl->nb->type == NB_TORRENTDATA) {
-                p->n->uploaded += bufdelta;
-                p->count_up += bufdelta;
+            peer_sent(p, nb);
+            if (nb->type == NB_TORRENTDATA)
+                net_count_up(p, bufdelta);
+            else if (nb->type == NB_PIECE) {
+                p->td_index = nb_get_index(nb);
+                p->td_begin = nb_get_begin(nb);
             }
             bcount -= bufdelta;
-            BTPDQ_REMOVE(&p->outq, nl, entry);
-            nb_drop(nl->nb);
-            free(nl);
-            p->outq_off = 0;
-            nl = BTPDQ_FIRST(&p->outq);
+            outq_pop(q);
+            nb_drop(nb);
         } else {
-            if (nl->nb->type == NB_TORRENTDATA) {
-                p->n->uploaded += bcount;
-                p->count_up += bcount;
-            }
-            p->outq_off +=  bcount;
+            if (nb->type == NB_TORRENTDATA)
+                net_count_up(p, bcount);
+            q->off += bcount;
             bcount = 0;
         }
     }
-    if (!BTPDQ_EMPTY(&p->outq))
+    if (!outq_empty(q))
         p->t_wantwrite = btpd_seconds;
     else
         btpd_ev_disable(&p->ioev, EV_WRITE);
@@ -312,7 +428,8 @@ net_progress(struct peer *p, size_t length)
 {
     if (p->in.state == BTP_MSGBODY && p->in.msg_num == MSG_PIECE) {
         p->n->downloaded += length;
-        p->count_dwn += length;
+        rate_add(&p->rate_dwn, length);
+        rate_add(&p->n->rate_dwn, length);
     }
 }
 
@@ -388,9 +505,41 @@ bad:
 
 #define GRBUFLEN (1 << 15)
 
+static struct pool m_piece_in_pool =
+    POOL_INITIALIZER("piece_in", PIECE_BLOCKLEN, 64);
+
+static int
+net_in_piece(struct peer *p)
+{
+    return p->in.state == BTP_MSGBODY && p->in.msg_num == MSG_PIECE;
+}
+
+static void
+net_in_free(char *buf, int piece)
+{
+    if (piece)
+        pool_put(&m_piece_in_pool, buf);
+    else
+        free(buf);
+}
+
+void
+net_in_release(struct peer *p)
+{
+    if (p->in.buf != NULL) {
+        net_in_free(p->in.buf, net_in_piece(p));
+        p->in.buf = NULL;
+    }
+}
+
 static unsigned long
 net_read(struct peer *p, unsigned long rmax)
 {
+    if (p->in.buf == NULL && net_in_piece(p) && p->in.st_bytes > 0) {
+        // Let the kernel copy the block straight into its own buffer.
+        p->in.buf = pool_get(&m_piece_in_pool);
+        p->in.off = 0;
+    }
     size_t rest = p->in.buf != NULL ? p->in.st_bytes - p->in.off : 0;
     char buf[GRBUFLEN];
     struct iovec iov[2] = {
@@ -429,9 +578,10 @@ net_read(struct peer *p, unsigned long rmax)
             goto out;
         }
         net_progress(p, rest);
+        int piece = net_in_piece(p);
         if (net_state(p, p->in.buf) != 0)
             return nread;
-        free(p->in.buf);
+        net_in_free(p->in.buf, piece);
         p->in.buf = NULL;
         p->in.off = 0;
     }
@@ -449,7 +599,10 @@ net_read(struct peer *p, unsigned long rmax)
     if (iov[1].iov_len > 0) {
         net_progress(p, iov[1].iov_len);
         p->in.off = iov[1].iov_len;
-        p->in.buf = btpd_malloc(p->in.st_bytes);
+        if (net_in_piece(p))
+            p->in.buf = pool_get(&m_piece_in_pool);
+        else
+            p->in.buf = btpd_malloc(p->in.st_bytes);
         bcopy(iov[1].iov_base, p->in.buf, iov[1].iov_len);
     }
 
@@ -527,86 +680,194 @@ net_connection_cb(int sd, short type, void *arg)
     btpd_log(BTPD_L_CONN, "got connection.\n");
 }
 
-static unsigned long
-compute_rate_sub(unsigned long rate)
+/*
+ * Returns the global limit if n is NULL, otherwise the torrent's.
+ */
+static unsigned
+bw_limit(struct net *n, enum bw_dir dir)
 {
-    if (rate > 256 * RATEHISTORY)
-        return rate / RATEHISTORY;
+    if (n == NULL)
+        return dir == BW_IN ? net_bw_limit_in : net_bw_limit_out;
     else
-        return min(256, rate);
+        return dir == BW_IN ? n->tp->tl->bw_limit_in : n->tp->tl->bw_limit_out;
+}
+
+/*
+ * Returns how many bytes the buckets above a peer in torrent n lets it
+ * transfer right now. ULONG_MAX means that no limit applies.
+ */
+static unsigned long
+bw_allowance(struct net *n, enum bw_dir dir)
+{
+    unsigned long allow = ULONG_MAX;
+    if (bw_limit(NULL, dir) > 0)
+        allow = m_bw_bytes[dir];
+    if (n != NULL && bw_limit(n, dir) > 0)
+        allow = min(allow, n->bw_bytes[dir]);
+    return allow;
 }
 
 static void
-compute_rates(void) {
-    unsigned long tot_up = 0, tot_dwn = 0;
+bw_transfer(struct peer *p, enum bw_dir dir, unsigned long allow)
+{
+    struct net *n = p->n;
+    unsigned long count;
+    if (allow == ULONG_MAX)
+        allow = 0;
+    // The peer may be gone after this.
+    count = dir == BW_IN ? net_read(p, allow) : net_write(p, allow);
+    if (bw_limit(NULL, dir) > 0)
+        m_bw_bytes[dir] -= min(count, m_bw_bytes[dir]);
+    if (n != NULL && bw_limit(n, dir) > 0)
+        n->bw_bytes[dir] -= min(count, n->bw_bytes[dir]);
+}
+
+static unsigned *
+bw_nwait(struct net *n)
+{
+    return n != NULL ? &n->bw_nwait : &m_bw_nwait;
+}
+
+static unsigned
+bw_weight(struct net *n)
+{
+    return n != NULL ? n->tp->tl->bw_weight : 1;
+}
+
+static void
+bw_wait_reset(void)
+{
     struct torrent *tp;
-    BTPDQ_FOREACH(tp, torrent_get_all(), entry) {
-        unsigned long tp_up = 0, tp_dwn = 0;
-        struct net *n = tp->net;
-        struct peer *p;
-        BTPDQ_FOREACH(p, &n->peers, p_entry) {
-            if (p->count_up > 0 || peer_active_up(p)) {
-                tp_up += p->count_up;
-                p->rate_up += p->count_up - compute_rate_sub(p->rate_up);
-                p->count_up = 0;
-            }
-            if (p->count_dwn > 0 || peer_active_down(p)) {
-                tp_dwn += p->count_dwn;
-                p->rate_dwn += p->count_dwn - compute_rate_sub(p->rate_dwn);
-                p->count_dwn = 0;
-            }
-        }
-        n->rate_up += tp_up - compute_rate_sub(n->rate_up);
-        n->rate_dwn += tp_dwn - compute_rate_sub(n->rate_dwn);
-        tot_up += tp_up;
-        tot_dwn += tp_dwn;
+    BTPDQ_FOREACH(tp, torrent_get_all(), entry)
+        tp->net->bw_nwait = 0;
+    m_bw_nwait = 0;
+    m_bw_weight = 0;
+}
+
+static void
+bw_wait_add(struct net *n)
+{
+    if ((*bw_nwait(n))++ == 0)
+        m_bw_weight += bw_weight(n);
+}
+
+/*
+ * Returns the part of the tokens to give the next waiting peer from
+ * torrent n. The global tokens are split between the waiting torrents
+ * by their weights and each torrent's part, like its own tokens,
+ * evenly between its waiting peers. What a peer leaves unused goes to
+ * those after it.
+ */
+static unsigned long
+bw_share(struct net *n, enum bw_dir dir)
+{
+    unsigned *nwait = bw_nwait(n);
+    unsigned weight = bw_weight(n);
+    unsigned long allow = bw_allowance(n, dir);
+    unsigned long share = allow;
+
+    if (*nwait == 0)
+        return allow;
+    if (allow > 0 && allow != ULONG_MAX) {
+        if (bw_limit(NULL, dir) > 0)
+            share = min(share, (unsigned long)((unsigned long long)
+                m_bw_bytes[dir] * weight / m_bw_weight / *nwait));
+        if (n != NULL && bw_limit(n, dir) > 0)
+            share = min(share, n->bw_bytes[dir] / *nwait);
+        share = min(allow, max(share, BW_MIN_SHARE));
     }
-    m_rate_up += tot_up - compute_rate_sub(m_rate_up);
-    m_rate_dwn += tot_dwn - compute_rate_sub(m_rate_dwn);
+    if (--*nwait == 0)
+        m_bw_weight -= weight;
+    return share;
 }
 
+/*
+ * Let the peers waiting for bandwidth have their shares of the new
+ * tokens, in the order they started waiting. Those that get nothing,
+ * because their torrent's bucket is empty, go to the back of the queue.
+ */
 static void
-net_bw_tick(void)
+bw_serve_readq(void)
 {
     struct peer *p;
+    unsigned count = 0;
 
-    m_bw_bytes_out = net_bw_limit_out;
-    m_bw_bytes_in = net_bw_limit_in;
-
-    if (net_bw_limit_in > 0) {
-        while ((p = BTPDQ_FIRST(&net_bw_readq)) != NULL && m_bw_bytes_in > 0) {
-            BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
-            btpd_ev_enable(&p->ioev, EV_READ);
-            p->mp->flags &= ~PF_ON_READQ;
-            m_bw_bytes_in -= net_read(p, m_bw_bytes_in);
-        }
-    } else {
-        while ((p = BTPDQ_FIRST(&net_bw_readq)) != NULL) {
-            BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
+    bw_wait_reset();
+    BTPDQ_FOREACH(p, &net_bw_readq, rq_entry) {
+        bw_wait_add(p->n);
+        count++;
+    }
+    while (count-- > 0 && (p = BTPDQ_FIRST(&net_bw_readq)) != NULL) {
+        unsigned long share = bw_share(p->n, BW_IN);
+        BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
+        if (share == 0)
+            BTPDQ_INSERT_TAIL(&net_bw_readq, p, rq_entry);
+        else {
             btpd_ev_enable(&p->ioev, EV_READ);
             p->mp->flags &= ~PF_ON_READQ;
-            net_read(p, 0);
+            bw_transfer(p, BW_IN, share);
         }
     }
+}
 
-    if (net_bw_limit_out) {
-        while (((p = BTPDQ_FIRST(&net_bw_writeq)) != NULL
-                   && m_bw_bytes_out > 0)) {
-            BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
-            btpd_ev_enable(&p->ioev, EV_WRITE);
-            p->mp->flags &= ~PF_ON_WRITEQ;
-            m_bw_bytes_out -=  net_write(p, m_bw_bytes_out);
-        }
-    } else {
-        while ((p = BTPDQ_FIRST(&net_bw_writeq)) != NULL) {
-            BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
+static void
+bw_serve_writeq(void)
+{
+    struct peer *p;
+    unsigned count = 0;
+
+    bw_wait_reset();
+    BTPDQ_FOREACH(p, &net_bw_writeq, wq_entry) {
+        bw_wait_add(p->n);
+        count++;
+    }
+    while (count-- > 0 && (p = BTPDQ_FIRST(&net_bw_writeq)) != NULL) {
+        unsigned long share = bw_share(p->n, BW_OUT);
+        BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
+        if (share == 0)
+            BTPDQ_INSERT_TAIL(&net_bw_writeq, p, wq_entry);
+        else {
             btpd_ev_enable(&p->ioev, EV_WRITE);
             p->mp->flags &= ~PF_ON_WRITEQ;
-            net_write(p, 0);
+            bw_transfer(p, BW_OUT, share);
         }
     }
 }
 
+/*
+ * Returns the bytes a limit of rate bytes per second allows in the
+ * current tick. The ticks of each second add up to exactly rate.
+ */
+static unsigned long
+bw_quantum(unsigned rate)
+{
+    unsigned long long k = m_bw_ticks % BW_HZ;
+    return rate * (k + 1) / BW_HZ - rate * k / BW_HZ;
+}
+
+static void
+bw_refill(void)
+{
+    struct torrent *tp;
+    m_bw_bytes[BW_IN] = bw_quantum(net_bw_limit_in);
+    m_bw_bytes[BW_OUT] = bw_quantum(net_bw_limit_out);
+    BTPDQ_FOREACH(tp, torrent_get_all(), entry) {
+        tp->net->bw_bytes[BW_IN] = bw_quantum(tp->tl->bw_limit_in);
+        tp->net->bw_bytes[BW_OUT] = bw_quantum(tp->tl->bw_limit_out);
+    }
+}
+
+static void
+net_bw_cb(int fd, short type, void *arg)
+{
+    btpd_timer_add(&m_bw_timer,
+        (& (struct timespec) { 0, 1000000000 / BW_HZ }));
+    m_bw_ticks++;
+    bw_refill();
+    bw_serve_readq();
+    bw_serve_writeq();
+}
+
 static void
 run_peer_ticks(void)
 {
@@ -625,17 +886,14 @@ void
 net_on_tick(void)
 {
     run_peer_ticks();
-    compute_rates();
-    net_bw_tick();
 }
 
 static void
 net_read_cb(struct peer *p)
 {
-    if (net_bw_limit_in == 0)
-        net_read(p, 0);
-    else if (m_bw_bytes_in > 0)
-        m_bw_bytes_in -= net_read(p, m_bw_bytes_in);
+    unsigned long allow = bw_allowance(p->n, BW_IN);
+    if (allow > 0)
+        bw_transfer(p, BW_IN, allow);
     else {
         btpd_ev_disable(&p->ioev, EV_READ);
         p->mp->flags |= PF_ON_READQ;
@@ -646,10 +904,9 @@ net_read_cb(struct peer *p)
 static void
 net_write_cb(struct peer *p)
 {
-    if (net_bw_limit_out == 0)
-        net_write(p, 0);
-    else if (m_bw_bytes_out > 0)
-        m_bw_bytes_out -= net_write(p, m_bw_bytes_out);
+    unsigned long allow = bw_allowance(p->n, BW_OUT);
+    if (allow > 0)
+        bw_transfer(p, BW_OUT, allow);
     else {
         btpd_ev_disable(&p->ioev, EV_WRITE);
         p->mp->flags |= PF_ON_WRITEQ;
@@ -695,8 +952,10 @@ net_shutdown(void)
 void
 net_init(void)
 {
-    m_bw_bytes_out = net_bw_limit_out;
-    m_bw_bytes_in = net_bw_limit_in;
+    bw_refill();
+    evtimer_init(&m_bw_timer, net_bw_cb, NULL);
+    btpd_timer_add(&m_bw_timer,
+        (& (struct timespec) { 0, 1000000000 / BW_HZ }));
 
     int safe_fds = getdtablesize() * 4 / 5;
     if (net_max_peers == 0 || net_max_peers > safe_fds)
@@ -11,8 +11,6 @@
 #define MSG_PIECE       7
 #define MSG_CANCEL      8
 
-#define RATEHISTORY 20
-
 extern struct peer_tq net_unattached;
 extern struct peer_tq net_bw_readq;
 extern struct peer_tq net_bw_writeq;
@@ -33,6 +31,7 @@ void net_ban_peer(struct net *n, struct meta_peer *mp);
 int net_torrent_has_peer(struct net *n, const uint8_t *id);
 
 void net_io_cb(int sd, short type, void *arg);
+void net_in_release(struct peer *p);
 
 int net_connect_addr(int family, struct sockaddr *sa, socklen_t salen,
     int *sd);
@@ -1,5 +1,11 @@
 #include "btpd.h"
 
+// Room for the largest message header, the handshake.
+#define NB_INLINE 68
+
+static struct pool m_nb_pool =
+    POOL_INITIALIZER("net_buf", sizeof(struct net_buf) + NB_INLINE, 1024);
+
 static struct net_buf *m_choke;
 static struct net_buf *m_unchoke;
 static struct net_buf *m_interest;
@@ -17,6 +23,12 @@ kill_buf_free(char *buf, size_t len)
     free(buf);
 }
 
+static void
+kill_buf_cache(char *buf, size_t len)
+{
+    cache_release((uint8_t *)buf);
+}
+
 static void
 kill_buf_abort(char *buf, size_t len)
 {
@@ -26,11 +38,16 @@ kill_buf_abort(char *buf, size_t len)
 static struct net_buf *
 nb_create_alloc(short type, size_t len)
 {
-    struct net_buf *nb = btpd_calloc(1, sizeof(*nb) + len);
+    struct net_buf *nb = pool_calloc(&m_nb_pool);
     nb->type = type;
-    nb->buf = (char *)(nb + 1);
+    if (len <= NB_INLINE) {
+        nb->buf = (char *)(nb + 1);
+        nb->kill_buf = kill_buf_no;
+    } else {
+        nb->buf = btpd_calloc(1, len);
+        nb->kill_buf = kill_buf_free;
+    }
     nb->len = len;
-    nb->kill_buf = kill_buf_no;
     return nb;
 }
 
@@ -38,7 +55,7 @@ static struct net_buf *
 nb_create_set(short type, char *buf, size_t len,
     void (*kill_buf)(char *, size_t))
 {
-    struct net_buf *nb = btpd_calloc(1, sizeof(*nb));
+    struct net_buf *nb = pool_calloc(&m_nb_pool);
     nb->type = type;
     nb->buf = buf;
     nb->len = len;
@@ -94,18 +111,58 @@ nb_create_torrentdata(void)
     return out;
 }
 
+struct nb_read {
+    struct net_buf *nb;
+    size_t len;
+    void (*cb)(void *, int);
+    void *arg;
+};
+
+static void
+nb_torrentdata_read(void *arg, int err, uint8_t *content)
+{
+    struct nb_read *nr = arg;
+    if (err == 0) {
+        nr->nb->buf = content;
+        nr->nb->len = nr->len;
+        nr->nb->kill_buf = kill_buf_cache;
+    }
+    nr->cb(nr->arg, err);
+    nb_drop(nr->nb);
+    free(nr);
+}
+
+/*
+ * Fill the buffer with torrent data. Returns EAGAIN if the data has to
+ * be read from disk first, in which case cb is called when the buffer
+ * has been filled or the read has failed.
+ */
 int
 nb_torrentdata_fill(struct net_buf *nb, struct torrent *tp, uint32_t index,
-    uint32_t begin, uint32_t length)
+    uint32_t begin, uint32_t length, void (*cb)(void *, int), void *arg)
 {
     int err;
     uint8_t *content;
+    struct nb_read *nr;
     assert(nb->type == NB_TORRENTDATA && nb->buf == NULL);
-    if ((err = cm_get_bytes(tp, index, begin, length, &content)) != 0)
+
+    nr = btpd_calloc(1, sizeof(*nr));
+    nr->nb = nb;
+    nr->len = length;
+    nr->cb = cb;
+    nr->arg = arg;
+    err = cache_get(tp, index, begin, length, &content, nb_torrentdata_read,
+        nr);
+    if (err == EAGAIN) {
+        nb_hold(nb);
+        return err;
+    }
+    free(nr);
+    if (err != 0)
         return err;
     nb->buf = content;
     nb->len = length;
-    nb->kill_buf = kill_buf_free;
+    nb->kill_buf = kill_buf_cache;
     return 0;
 }
 
@@ -147,14 +204,14 @@ struct net_buf *
 nb_create_multihave(struct torrent *tp)
 {
     uint32_t have_npieces = cm_pieces(tp);
+    const uint8_t *field = cm_get_piece_field(tp);
     struct net_buf *out = nb_create_alloc(NB_MULTIHAVE, 9 * have_npieces);
-    for (uint32_t i = 0, count = 0; count < have_npieces; i++) {
-        if (cm_has_piece(tp, i)) {
-            enc_be32(out->buf + count * 9, 5);
-            out->buf[count * 9 + 4] = MSG_HAVE;
-            enc_be32(out->buf + count * 9 + 5, i);
-            count++;
-        }
+    uint32_t i = bitset_next(field, tp->npieces, 0);
+    for (uint32_t count = 0; count < have_npieces; count++) {
+        enc_be32(out->buf + count * 9, 5);
+        out->buf[count * 9 + 4] = MSG_HAVE;
+        enc_be32(out->buf + count * 9 + 5, i);
+        i = bitset_next(field, tp->npieces, i + 1);
     }
     return out;
 }
@@ -271,7 +328,7 @@ nb_drop(struct net_buf *nb)
     nb->refs--;
     if (nb->refs == 0) {
         nb->kill_buf(nb->buf, nb->len);
-        free(nb);
+        pool_put(&m_nb_pool, nb);
         return 1;
     } else
         return 0;
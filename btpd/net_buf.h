@@ -24,13 +24,6 @@ struct net_buf {
     void (*kill_buf)(char *, size_t);
 };
 
-struct nb_link {
-    struct net_buf *nb;
-    BTPDQ_ENTRY(nb_link) entry;
-};
-
-BTPDQ_HEAD(nb_tq, nb_link);
-
 struct torrent;
 struct peer;
 
@@ -52,7 +45,7 @@ struct net_buf *nb_create_bitdata(struct torrent *tp);
 struct net_buf *nb_create_shake(struct torrent *tp);
 
 int nb_torrentdata_fill(struct net_buf *nb, struct torrent *tp, uint32_t index,
-    uint32_t begin, uint32_t length);
+    uint32_t begin, uint32_t length, void (*cb)(void *, int), void *arg);
 
 int nb_drop(struct net_buf *nb);
 void nb_hold(struct net_buf *nb);
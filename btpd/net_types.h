@@ -15,11 +15,24 @@ struct net {
 
     uint8_t *busy_field;
     uint32_t npcs_busy;
-    unsigned *piece_count;
+    unsigned *piece_count;  // Not counting the seeds in nseeds.
+    unsigned nseeds;
+    uint32_t npcs_seen;     // Pieces with a non zero piece_count.
     struct piece_tq getlst;
+    struct piece **pcs;     // The busy pieces by index.
+    uint32_t *rarity;       // The pieces we could start on, rarest first.
+    uint32_t *rpos;         // The position of each piece in rarity.
+    uint32_t *rbucket;
+    unsigned nrbuckets;
 
-    unsigned long rate_up, rate_dwn;
+    struct rate_meter rate_up, rate_dwn;
     unsigned long long uploaded, downloaded;
+    // Bytes left in this tick's download and upload buckets.
+    unsigned long bw_bytes[2];
+    unsigned bw_nwait;      // Peers counted waiting on a bandwidth queue.
+
+    // Scratch space for the choker.
+    unsigned ul_ndemand, ul_nchoked, ul_nslots, ul_order;
 
     unsigned npeers;
     struct peer_tq peers;
@@ -61,15 +74,22 @@ struct peer {
     struct block_request_tq my_reqs;
 
     unsigned nreqs_out;
+    unsigned maxreqs;
+    // The lowest request round trip seen, in microseconds.
+    unsigned long long rtt;
     unsigned npiece_msgs;
 
-    size_t outq_off;
-    struct nb_tq outq;
+    struct outq outq;
+    // Position of the torrent data last announced by a piece message.
+    uint32_t td_index, td_begin;
+    // The last piece requested by the peer, plus one. Zero if none.
+    uint32_t prefetched;
 
     struct fdev ioev;
 
-    unsigned long rate_up, rate_dwn;
-    unsigned long count_up, count_dwn;
+    struct rate_meter rate_up, rate_dwn;
+    unsigned long long uploaded;        // Torrent data sent to the peer.
+    unsigned long long ul_unchoked_at;  // The value of uploaded at unchoke.
 
     long t_created;
     long t_lastwrite;
@@ -88,7 +108,6 @@ struct peer {
     } in;
 
     BTPDQ_ENTRY(peer) p_entry;
-    BTPDQ_ENTRY(peer) ul_entry;
     BTPDQ_ENTRY(peer) rq_entry;
     BTPDQ_ENTRY(peer) wq_entry;
 };
@@ -106,9 +125,11 @@ struct piece {
     unsigned next_block;
 
     struct net_buf **eg_reqs;
-    struct block_request_tq reqs;
+    struct block_request_tq *reqs;  // The requests for each block.
     struct blog_tq logs;
 
+    struct piece_sha *sha;
+
     const uint8_t *have_field;
     uint8_t *down_field;
 
@@ -130,6 +151,9 @@ struct blog_record {
 struct block_request {
     struct peer *p;
     struct net_buf *msg;
+    unsigned seq;   // Position of msg in the peer's outq.
+    uint32_t index, begin, length;
+    unsigned long long t_sent;
     BTPDQ_ENTRY(block_request) p_entry;
     BTPDQ_ENTRY(block_request) blk_entry;
 };
@@ -14,3 +14,12 @@ const char *tr_ip_arg;
 int net_ipv4 = 1;
 int net_ipv6 = 0;
 unsigned net_numwant = 50;
+int wk_nthreads = 2;
+int dl_inline_hash = 0;
+size_t cache_size = 4096 * 1024;
+int net_sendfile = 0;
+size_t cm_wbuf_size = 16384 * 1024;
+unsigned net_min_reqs = 10;
+unsigned net_max_reqs = MAXREQS;
+unsigned ipc_rate_window = 10;
+enum ipc_choker net_seed_choker = IPC_CHOKER_FASTEST;
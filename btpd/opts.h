@@ -14,5 +14,14 @@ extern int empty_start;
 extern const char *tr_ip_arg;
 extern int net_ipv4, net_ipv6;
 extern unsigned net_numwant;
+extern int wk_nthreads;
+extern int dl_inline_hash;
+extern size_t cache_size;
+extern int net_sendfile;
+extern size_t cm_wbuf_size;
+extern unsigned net_min_reqs;
+extern unsigned net_max_reqs;
+extern unsigned ipc_rate_window;
+extern enum ipc_choker net_seed_choker;
 
 #endif
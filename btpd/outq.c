@@ -0,0 +1,177 @@
+#include "btpd.h"
+
+#define OUTQ_INITSIZE 16
+#define OUTQ_PCS_INITSIZE 16
+
+static unsigned
+pcs_hash(uint32_t index, uint32_t begin)
+{
+    return index * 2654435761U ^ begin / PIECE_BLOCKLEN;
+}
+
+static void
+pcs_insert(struct outq *q, uint32_t index, uint32_t begin, unsigned seq,
+    struct net_buf *nb)
+{
+    if (2 * (q->npcs + 1) > q->pcs_mask + 1) {
+        struct outq_piece *old = q->pcs;
+        unsigned oldsize = q->pcs_mask + 1;
+        q->pcs_mask = 2 * oldsize - 1;
+        q->pcs = btpd_calloc(q->pcs_mask + 1, sizeof(*q->pcs));
+        q->npcs = 0;
+        for (unsigned i = 0; i < oldsize; i++)
+            if (old[i].nb != NULL)
+                pcs_insert(q, old[i].index, old[i].begin, old[i].seq,
+                    old[i].nb);
+        free(old);
+    }
+    unsigned i = pcs_hash(index, begin) & q->pcs_mask;
+    while (q->pcs[i].nb != NULL)
+        i = (i + 1) & q->pcs_mask;
+    q->pcs[i].index = index;
+    q->pcs[i].begin = begin;
+    q->pcs[i].seq = seq;
+    q->pcs[i].nb = nb;
+    q->npcs++;
+}
+
+static void
+pcs_remove(struct outq *q, unsigned seq, struct net_buf *nb)
+{
+    unsigned i = pcs_hash(nb_get_index(nb), nb_get_begin(nb)) & q->pcs_mask;
+    while (q->pcs[i].seq != seq || q->pcs[i].nb != nb) {
+        assert(q->pcs[i].nb != NULL);
+        i = (i + 1) & q->pcs_mask;
+    }
+    // Move entries later in the probe sequence into the hole.
+    unsigned j = i;
+    for (;;) {
+        q->pcs[i].nb = NULL;
+        do {
+            j = (j + 1) & q->pcs_mask;
+            if (q->pcs[j].nb == NULL) {
+                q->npcs--;
+                return;
+            }
+        } while (((j - (pcs_hash(q->pcs[j].index, q->pcs[j].begin)
+                       & q->pcs_mask)) & q->pcs_mask) < ((j - i) & q->pcs_mask));
+        q->pcs[i] = q->pcs[j];
+        i = j;
+    }
+}
+
+void
+outq_init(struct outq *q)
+{
+    bzero(q, sizeof(*q));
+    q->mask = OUTQ_INITSIZE - 1;
+    q->ring = btpd_calloc(OUTQ_INITSIZE, sizeof(*q->ring));
+    q->pcs_mask = OUTQ_PCS_INITSIZE - 1;
+    q->pcs = btpd_calloc(OUTQ_PCS_INITSIZE, sizeof(*q->pcs));
+}
+
+void
+outq_clear(struct outq *q)
+{
+    for (unsigned seq = q->head; seq != q->tail; seq++)
+        if (q->ring[seq & q->mask] != NULL)
+            nb_drop(q->ring[seq & q->mask]);
+    free(q->ring);
+    free(q->pcs);
+    bzero(q, sizeof(*q));
+}
+
+unsigned
+outq_push(struct outq *q, struct net_buf *nb)
+{
+    if (q->tail - q->head == q->mask + 1) {
+        unsigned size = 2 * (q->mask + 1);
+        struct net_buf **ring = btpd_calloc(size, sizeof(*ring));
+        for (unsigned seq = q->head; seq != q->tail; seq++)
+            ring[seq & (size - 1)] = q->ring[seq & q->mask];
+        free(q->ring);
+        q->ring = ring;
+        q->mask = size - 1;
+    }
+    unsigned seq = q->tail++;
+    q->ring[seq & q->mask] = nb;
+    q->count++;
+    if (nb->type == NB_PIECE)
+        pcs_insert(q, nb_get_index(nb), nb_get_begin(nb), seq, nb);
+    return seq;
+}
+
+/*
+ * Remove the entry at seq from the queue. The caller keeps the
+ * reference to the removed buffer.
+ */
+void
+outq_remove(struct outq *q, unsigned seq)
+{
+    struct net_buf *nb = outq_at(q, seq);
+    assert(nb != NULL);
+    if (nb->type == NB_PIECE)
+        pcs_remove(q, seq, nb);
+    q->ring[seq & q->mask] = NULL;
+    q->count--;
+    if (seq == q->head)
+        q->off = 0;
+    while (q->head != q->tail && q->ring[q->head & q->mask] == NULL)
+        q->head++;
+    while (q->tail != q->head && q->ring[(q->tail - 1) & q->mask] == NULL)
+        q->tail--;
+}
+
+/*
+ * Remove and return the first entry of the queue.
+ */
+struct net_buf *
+outq_pop(struct outq *q)
+{
+    struct net_buf *nb = outq_first(q);
+    outq_remove(q, q->head);
+    return nb;
+}
+
+struct net_buf *
+outq_at(struct outq *q, unsigned seq)
+{
+    if (seq - q->head < q->tail - q->head)
+        return q->ring[seq & q->mask];
+    else
+        return NULL;
+}
+
+/*
+ * Returns the sequence number of the next entry after seq, or the tail
+ * of the queue if there is none.
+ */
+unsigned
+outq_next(struct outq *q, unsigned seq)
+{
+    do
+        seq++;
+    while (seq != q->tail && q->ring[seq & q->mask] == NULL);
+    return seq;
+}
+
+struct net_buf *
+outq_last(struct outq *q)
+{
+    return q->count > 0 ? q->ring[(q->tail - 1) & q->mask] : NULL;
+}
+
+int
+outq_find_piece(struct outq *q, uint32_t index, uint32_t begin,
+    unsigned *seq)
+{
+    unsigned i = pcs_hash(index, begin) & q->pcs_mask;
+    while (q->pcs[i].nb != NULL) {
+        if (q->pcs[i].index == index && q->pcs[i].begin == begin) {
+            *seq = q->pcs[i].seq;
+            return 1;
+        }
+        i = (i + 1) & q->pcs_mask;
+    }
+    return 0;
+}
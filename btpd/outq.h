@@ -0,0 +1,46 @@
+#ifndef BTPD_OUTQ_H
+#define BTPD_OUTQ_H
+
+/*
+ * A peer's queue of network buffers waiting to be sent. The buffers are
+ * kept in a ring and addressed by a sequence number, which stays valid
+ * until the entry is sent or removed. Entries removed from the middle of
+ * the queue are left as empty slots and skipped. Queued piece messages
+ * are also indexed by (index, begin).
+ */
+struct outq_piece {
+    uint32_t index;
+    uint32_t begin;
+    unsigned seq;
+    struct net_buf *nb;
+};
+
+struct outq {
+    struct net_buf **ring;
+    unsigned mask;
+    unsigned head, tail;
+    unsigned count;
+    size_t off;     // Bytes of the head entry already sent.
+
+    struct outq_piece *pcs;
+    unsigned pcs_mask;
+    unsigned npcs;
+};
+
+void outq_init(struct outq *q);
+void outq_clear(struct outq *q);
+
+unsigned outq_push(struct outq *q, struct net_buf *nb);
+struct net_buf *outq_pop(struct outq *q);
+void outq_remove(struct outq *q, unsigned seq);
+
+struct net_buf *outq_at(struct outq *q, unsigned seq);
+unsigned outq_next(struct outq *q, unsigned seq);
+struct net_buf *outq_last(struct outq *q);
+int outq_find_piece(struct outq *q, uint32_t index, uint32_t begin,
+    unsigned *seq);
+
+#define outq_empty(q) ((q)->count == 0)
+#define outq_first(q) ((q)->ring[(q)->head & (q)->mask])
+
+#endif
@@ -36,8 +36,6 @@ mp_drop(struct meta_peer *mp, struct net *n)
 void
 peer_kill(struct peer *p)
 {
-    struct nb_link *nl;
-
     btpd_log(BTPD_L_CONN, "killed peer %p\n", p);
 
     if (p->mp->flags & PF_ATTACHED) {
@@ -57,18 +55,11 @@ peer_kill(struct peer *p)
     btpd_ev_del(&p->ioev);
     close(p->sd);
 
-    nl = BTPDQ_FIRST(&p->outq);
-    while (nl != NULL) {
-        struct nb_link *next = BTPDQ_NEXT(nl, entry);
-        nb_drop(nl->nb);
-        free(nl);
-        nl = next;
-    }
+    outq_clear(&p->outq);
 
     p->mp->p = NULL;
     mp_drop(p->mp, p->n);
-    if (p->in.buf != NULL)
-        free(p->in.buf);
+    net_in_release(p);
     if (p->piece_field != NULL)
         free(p->piece_field);
     if (p->bad_field != NULL)
@@ -84,19 +75,23 @@ peer_set_in_state(struct peer *p, enum input_state state, size_t size)
     p->in.st_bytes = size;
 }
 
-void
-peer_send(struct peer *p, struct net_buf *nb)
+static unsigned
+peer_queue(struct peer *p, struct net_buf *nb)
 {
-    struct nb_link *nl = btpd_calloc(1, sizeof(*nl));
-    nl->nb = nb;
     nb_hold(nb);
 
-    if (BTPDQ_EMPTY(&p->outq)) {
-        assert(p->outq_off == 0);
+    if (outq_empty(&p->outq)) {
+        assert(p->outq.off == 0);
         btpd_ev_enable(&p->ioev, EV_WRITE);
         p->t_wantwrite = btpd_seconds;
     }
-    BTPDQ_INSERT_TAIL(&p->outq, nl, entry);
+    return outq_push(&p->outq, nb);
+}
+
+void
+peer_send(struct peer *p, struct net_buf *nb)
+{
+    peer_queue(p, nb);
 }
 
 /*
@@ -107,17 +102,17 @@ peer_send(struct peer *p, struct net_buf *nb)
  * Returns 1 if the buffer is removed, 0 if not.
  */
 int
-peer_unsend(struct peer *p, struct nb_link *nl)
+peer_unsend(struct peer *p, unsigned seq)
 {
-    if (!(nl == BTPDQ_FIRST(&p->outq) && p->outq_off > 0)) {
-        BTPDQ_REMOVE(&p->outq, nl, entry);
-        if (nl->nb->type == NB_TORRENTDATA) {
+    if (!(seq == p->outq.head && p->outq.off > 0)) {
+        struct net_buf *nb = outq_at(&p->outq, seq);
+        outq_remove(&p->outq, seq);
+        if (nb->type == NB_TORRENTDATA) {
             assert(p->npiece_msgs > 0);
             p->npiece_msgs--;
         }
-        nb_drop(nl->nb);
-        free(nl);
-        if (BTPDQ_EMPTY(&p->outq)) {
+        nb_drop(nb);
+        if (outq_empty(&p->outq)) {
             if (p->mp->flags & PF_ON_WRITEQ) {
                 BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
                 p->mp->flags &= ~PF_ON_WRITEQ;
@@ -129,9 +124,18 @@ peer_unsend(struct peer *p, struct nb_link *nl)
         return 0;
 }
 
+static unsigned long long
+peer_usecs(void)
+{
+    struct timespec ts;
+    evtimer_gettime(&ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void
 peer_sent(struct peer *p, struct net_buf *nb)
 {
+    struct block_request *req;
     switch (nb->type) {
     case NB_KEEPALIVE:
         btpd_log(BTPD_L_MSG, "sent keepalive to %p\n", p);
@@ -159,6 +163,11 @@ peer_sent(struct peer *p, struct net_buf *nb)
     case NB_REQUEST:
         btpd_log(BTPD_L_MSG, "sent request(%u,%u,%u) to %p\n",
             nb_get_index(nb), nb_get_begin(nb), nb_get_length(nb), p);
+        // The round trip starts when the request leaves us, not when it
+        // was queued behind our other messages.
+        req = dl_find_request(p, nb_get_index(nb), nb_get_begin(nb));
+        if (req != NULL)
+            req->t_sent = peer_usecs();
         break;
     case NB_PIECE:
         btpd_log(BTPD_L_MSG, "sent piece(%u,%u,%u) to %p\n",
@@ -185,24 +194,37 @@ peer_sent(struct peer *p, struct net_buf *nb)
     }
 }
 
+/*
+ * Keep about twice the bandwidth delay product of the connection in
+ * requests, so that the peer never runs dry. The round trip is the
+ * lowest one seen, since later ones include the time our requests
+ * spend queued behind each other.
+ */
+static void
+peer_update_maxreqs(struct peer *p, unsigned long long rtt)
+{
+    if (p->rtt == 0 || rtt < p->rtt)
+        p->rtt = max(rtt, 1);
+    unsigned long long bdp =
+        (unsigned long long)rate_get(&p->rate_dwn, 1) * p->rtt / 1000000;
+    unsigned long long reqs = 2 * bdp / PIECE_BLOCKLEN + 1;
+    p->maxreqs = min(max(reqs, net_min_reqs), net_max_reqs);
+}
+
 void
 peer_request(struct peer *p, struct block_request *req)
 {
-    assert(p->nreqs_out < MAXPIPEDREQUESTS);
+    assert(p->nreqs_out < p->maxreqs);
     p->nreqs_out++;
+    req->t_sent = 0;
     BTPDQ_INSERT_TAIL(&p->my_reqs, req, p_entry);
-    peer_send(p, req->msg);
+    req->seq = peer_queue(p, req->msg);
 }
 
 int
 peer_requested(struct peer *p, uint32_t piece, uint32_t block)
 {
-    uint32_t begin = block * PIECE_BLOCKLEN;
-    struct block_request *req;
-    BTPDQ_FOREACH(req, &p->my_reqs, p_entry)
-        if (nb_get_index(req->msg) == piece && nb_get_begin(req->msg) == begin)
-            return 1;
-    return 0;
+    return dl_find_request(p, piece, block * PIECE_BLOCKLEN) != NULL;
 }
 
 void
@@ -218,13 +240,8 @@ peer_cancel(struct peer *p, struct block_request *req, struct net_buf *nb)
     p->nreqs_out--;
 
     int removed = 0;
-    struct nb_link *nl;
-    BTPDQ_FOREACH(nl, &p->outq, entry) {
-        if (nl->nb == req->msg) {
-            removed = peer_unsend(p, nl);
-            break;
-        }
-    }
+    if (outq_at(&p->outq, req->seq) == req->msg)
+        removed = peer_unsend(p, req->seq);
     if (!removed)
         peer_send(p, nb);
     if (p->nreqs_out == 0)
@@ -241,16 +258,13 @@ peer_unchoke(struct peer *p)
 void
 peer_choke(struct peer *p)
 {
-    struct nb_link *nl = BTPDQ_FIRST(&p->outq);
-    while (nl != NULL) {
-        struct nb_link *next = BTPDQ_NEXT(nl, entry);
-        if (nl->nb->type == NB_PIECE) {
-            struct nb_link *data = next;
-            next = BTPDQ_NEXT(next, entry);
-            if (peer_unsend(p, nl))
-                peer_unsend(p, data);
+    unsigned end = p->outq.tail;
+    for (unsigned seq = p->outq.head; seq != end; seq++) {
+        struct net_buf *nb = outq_at(&p->outq, seq);
+        if (nb != NULL && nb->type == NB_PIECE && peer_unsend(p, seq)) {
+            peer_unsend(p, seq + 1);
+            seq++;
         }
-        nl = next;
     }
 
     p->mp->flags |= PF_I_CHOKE;
@@ -262,18 +276,29 @@ peer_want(struct peer *p, uint32_t index)
 {
     if (!has_bit(p->piece_field, index) || peer_has_bad(p, index))
         return;
-    assert(p->nwant < p->npieces);
-    p->nwant++;
-    if (p->nwant == 1) {
+    peer_want_count(p, 1);
+}
+
+/*
+ * Increase the wanted level of the peer by count pieces at once.
+ */
+void
+peer_want_count(struct peer *p, uint32_t count)
+{
+    if (count == 0)
+        return;
+    assert(p->nwant + count <= p->npieces);
+    p->nwant += count;
+    if (p->nwant == count) {
         p->mp->flags |= PF_I_WANT;
         if (p->mp->flags & PF_SUSPECT)
             return;
         if (p->nreqs_out == 0) {
             assert((p->mp->flags & PF_DO_UNWANT) == 0);
             int unsent = 0;
-            struct nb_link *nl = BTPDQ_LAST(&p->outq, nb_tq);
-            if (nl != NULL && nl->nb->type == NB_UNINTEREST)
-                unsent = peer_unsend(p, nl);
+            struct net_buf *nb = outq_last(&p->outq);
+            if (nb != NULL && nb->type == NB_UNINTEREST)
+                unsent = peer_unsend(p, p->outq.tail - 1);
             if (!unsent)
                 peer_send(p, nb_create_interest());
         } else {
@@ -316,8 +341,9 @@ peer_create_common(int sd)
     p->t_created = btpd_seconds;
     p->t_lastwrite = btpd_seconds;
     p->t_nointerest = btpd_seconds;
+    p->maxreqs = net_min_reqs;
     BTPDQ_INIT(&p->my_reqs);
-    BTPDQ_INIT(&p->outq);
+    outq_init(&p->outq);
 
     peer_set_in_state(p, SHAKE_PSTR, 28);
 
@@ -445,12 +471,11 @@ peer_on_choke(struct peer *p)
     else {
         p->mp->flags |= PF_P_CHOKE;
         dl_on_choke(p);
-        struct nb_link *nl = BTPDQ_FIRST(&p->outq);
-        while (nl != NULL) {
-            struct nb_link *next = BTPDQ_NEXT(nl, entry);
-            if (nl->nb->type == NB_REQUEST)
-                peer_unsend(p, nl);
-            nl = next;
+        unsigned end = p->outq.tail;
+        for (unsigned seq = p->outq.head; seq != end; seq++) {
+            struct net_buf *nb = outq_at(&p->outq, seq);
+            if (nb != NULL && nb->type == NB_REQUEST)
+                peer_unsend(p, seq);
         }
     }
 }
@@ -508,26 +533,20 @@ peer_on_bitfield(struct peer *p, const uint8_t *field)
 {
     btpd_log(BTPD_L_MSG, "received bitfield from %p\n", p);
     assert(p->npieces == 0);
-    bcopy(field, p->piece_field, (size_t)ceil(p->n->tp->npieces / 8.0));
-    for (uint32_t i = 0; i < p->n->tp->npieces; i++) {
-        if (has_bit(p->piece_field, i)) {
-            p->npieces++;
-            dl_on_piece_ann(p, i);
-        }
-    }
+    uint32_t npieces = p->n->tp->npieces;
+    bcopy(field, p->piece_field, (size_t)ceil(npieces / 8.0));
+    p->npieces = bitset_count(p->piece_field, npieces);
+    dl_on_bitfield(p);
 }
 
 void
 peer_on_piece(struct peer *p, uint32_t index, uint32_t begin,
     uint32_t length, const char *data)
 {
-    struct block_request *req;
-    BTPDQ_FOREACH(req, &p->my_reqs, p_entry)
-        if ((nb_get_begin(req->msg) == begin &&
-                nb_get_index(req->msg) == index &&
-                nb_get_length(req->msg) == length))
-            break;
-    if (req != NULL) {
+    struct block_request *req = dl_find_request(p, index, begin);
+    if (req != NULL && req->length == length) {
+        if (req->t_sent != 0)
+            peer_update_maxreqs(p, peer_usecs() - req->t_sent);
         btpd_log(BTPD_L_MSG, "received piece(%u,%u,%u) from %p\n",
             index, begin, length, p);
         assert(p->nreqs_out > 0);
@@ -548,6 +567,12 @@ peer_on_request(struct peer *p, uint32_t index, uint32_t begin,
     btpd_log(BTPD_L_MSG, "received request(%u,%u,%u) from %p\n",
         index, begin, length, p);
     if ((p->mp->flags & PF_NO_REQUESTS) == 0) {
+        // Peers usually request a piece's blocks in order, so read
+        // ahead when one starts on a new piece.
+        if (p->prefetched != index + 1) {
+            cm_prefetch(p->n->tp, index, begin);
+            p->prefetched = index + 1;
+        }
         peer_send(p, nb_create_piece(index, begin, length));
         peer_send(p, nb_create_torrentdata());
         p->npiece_msgs++;
@@ -565,17 +590,11 @@ peer_on_cancel(struct peer *p, uint32_t index, uint32_t begin,
 {
     btpd_log(BTPD_L_MSG, "received cancel(%u,%u,%u) from %p\n",
         index, begin, length, p);
-    struct nb_link *nl;
-    BTPDQ_FOREACH(nl, &p->outq, entry)
-        if (nl->nb->type == NB_PIECE
-            && nb_get_begin(nl->nb) == begin
-            && nb_get_index(nl->nb) == index
-            && nb_get_length(nl->nb) == length) {
-            struct nb_link *data = BTPDQ_NEXT(nl, entry);
-            if (peer_unsend(p, nl))
-                peer_unsend(p, data);
-            break;
-        }
+    unsigned seq;
+    if (outq_find_piece(&p->outq, index, begin, &seq)
+        && nb_get_length(outq_at(&p->outq, seq)) == length
+        && peer_unsend(p, seq))
+        peer_unsend(p, seq + 1);
 }
 
 void
@@ -584,7 +603,7 @@ peer_on_tick(struct peer *p)
     if (p->mp->flags & PF_BANNED)
         goto kill;
     if (p->mp->flags & PF_ATTACHED) {
-        if (BTPDQ_EMPTY(&p->outq)) {
+        if (outq_empty(&p->outq)) {
             if (btpd_seconds - p->t_lastwrite >= 120)
                 peer_keepalive(p);
         } else if (btpd_seconds - p->t_wantwrite >= 60) {
@@ -672,7 +691,7 @@ peer_has_bad(struct peer *p, uint32_t index)
 int
 peer_laden(struct peer *p)
 {
-    return p->nreqs_out >= MAXPIPEDREQUESTS;
+    return p->nreqs_out >= p->maxreqs;
 }
 
 int
@@ -13,14 +13,23 @@
 #define PF_DO_UNWANT    0x200
 #define PF_SUSPECT      0x400
 #define PF_BANNED       0x800
+#define PF_READING     0x1000   /* Waiting for torrent data from disk */
+#define PF_SEED_COUNTED 0x2000  /* Counted in n->nseeds, not piece_count */
+#define PF_UL_CHOSEN    0x4000  /* Unchoked for its rate this choke round */
 
 #define MAXPIECEMSGS 128
-#define MAXPIPEDREQUESTS 10
+
+/*
+ * The most requests kept outstanding to a peer. A btpd peer chokes us
+ * and drops our requests when it has MAXPIECEMSGS of them queued, so
+ * stay below that.
+ */
+#define MAXREQS (MAXPIECEMSGS - 1)
 
 void peer_set_in_state(struct peer *p, enum input_state state, size_t size);
 
 void peer_send(struct peer *p, struct net_buf *nb);
-int peer_unsend(struct peer *p, struct nb_link *nl);
+int peer_unsend(struct peer *p, unsigned seq);
 void peer_sent(struct peer *p, struct net_buf *nb);
 
 void peer_keepalive(struct peer *p);
@@ -28,6 +37,7 @@ void peer_unchoke(struct peer *p);
 void peer_choke(struct peer *p);
 void peer_unwant(struct peer *p, uint32_t index);
 void peer_want(struct peer *p, uint32_t index);
+void peer_want_count(struct peer *p, uint32_t count);
 void peer_request(struct peer *p, struct block_request *req);
 void peer_cancel(struct peer *p, struct block_request *req,
     struct net_buf *nb);
@@ -0,0 +1,72 @@
+#include "btpd.h"
+
+#define POOL_STATS_INTERVAL 3600
+
+static struct pool *m_pools;
+static struct timeout m_statsev;
+
+void *
+pool_get(struct pool *pl)
+{
+    void *obj;
+    if (!pl->listed) {
+        pl->listed = 1;
+        pl->next = m_pools;
+        m_pools = pl;
+    }
+    pl->nget++;
+    pl->nused++;
+    if ((obj = pl->free) != NULL) {
+        pl->free = *(void **)obj;
+        pl->nfree--;
+        pl->nreused++;
+        return obj;
+    }
+    return btpd_malloc(max(pl->size, sizeof(void *)));
+}
+
+void *
+pool_calloc(struct pool *pl)
+{
+    void *obj = pool_get(pl);
+    bzero(obj, pl->size);
+    return obj;
+}
+
+void
+pool_put(struct pool *pl, void *obj)
+{
+    assert(pl->nused > 0);
+    pl->nused--;
+    if (pl->nfree < pl->max_free) {
+        *(void **)obj = pl->free;
+        pl->free = obj;
+        pl->nfree++;
+    } else
+        free(obj);
+}
+
+void
+pool_log_stats(void)
+{
+    for (struct pool *pl = m_pools; pl != NULL; pl = pl->next)
+        btpd_log(BTPD_L_BTPD, "pool %s: %u used, %u free, %llu gets, "
+            "%llu reused.\n", pl->name, pl->nused, pl->nfree, pl->nget,
+            pl->nreused);
+}
+
+static void
+stats_cb(int fd, short type, void *arg)
+{
+    pool_log_stats();
+    btpd_timer_add(&m_statsev,
+        (& (struct timespec) { POOL_STATS_INTERVAL, 0 }));
+}
+
+void
+pool_init(void)
+{
+    evtimer_init(&m_statsev, stats_cb, NULL);
+    btpd_timer_add(&m_statsev,
+        (& (struct timespec) { POOL_STATS_INTERVAL, 0 }));
+}
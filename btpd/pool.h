@@ -0,0 +1,34 @@
+#ifndef BTPD_POOL_H
+#define BTPD_POOL_H
+
+/*
+ * A pool of equally sized objects. Objects given back to the pool are
+ * kept on a free list, up to max_free of them, and are handed out again
+ * before any new memory is allocated. Only for the event loop thread.
+ */
+struct pool {
+    const char *name;
+    size_t size;
+    unsigned max_free;
+
+    void *free;
+    unsigned nfree;
+    unsigned nused;
+    unsigned long long nget;
+    unsigned long long nreused;
+    int listed;
+    struct pool *next;
+};
+
+#define POOL_INITIALIZER(name, size, max_free) \
+    { (name), (size), (max_free), NULL, 0, 0, 0, 0, 0, NULL }
+
+void pool_init(void);
+
+void *pool_get(struct pool *pl);
+void *pool_calloc(struct pool *pl);
+void pool_put(struct pool *pl, void *obj);
+
+void pool_log_stats(void);
+
+#endif
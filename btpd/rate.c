@@ -0,0 +1,71 @@
+#include "btpd.h"
+
+static unsigned long
+rate_now(void)
+{
+    struct timespec ts;
+    evtimer_gettime(&ts);
+    return (unsigned long)ts.tv_sec * RATE_HZ
+        + ts.tv_nsec / (1000000000 / RATE_HZ);
+}
+
+/*
+ * Move the meter forward to the tick now, finishing the ticks and
+ * seconds that have passed since it was last used.
+ */
+static void
+rate_update(struct rate_meter *m, unsigned long now)
+{
+    if (now - m->tick > RATE_HZ * (RATE_SECS + 1)) {
+        // Everything the meter remembers is too old.
+        rate_clear(m);
+        m->tick = now;
+        return;
+    }
+    while (m->tick < now) {
+        m->ticks[m->tick % RATE_HZ] = m->cur;
+        m->sec += m->cur;
+        m->cur = 0;
+        m->tick++;
+        if (m->tick % RATE_HZ == 0) {
+            m->secs[(m->tick / RATE_HZ - 1) % RATE_SECS] = m->sec;
+            m->sec = 0;
+        }
+    }
+}
+
+void
+rate_clear(struct rate_meter *m)
+{
+    bzero(m, sizeof(*m));
+}
+
+void
+rate_add(struct rate_meter *m, unsigned long bytes)
+{
+    rate_update(m, rate_now());
+    m->cur += bytes;
+}
+
+/*
+ * Returns the average rate in bytes per second over the last window
+ * seconds. A one second window is measured over the last ten finished
+ * ticks, the longer ones over the last finished seconds.
+ */
+unsigned long
+rate_get(struct rate_meter *m, unsigned window)
+{
+    unsigned long long sum = 0;
+    assert(window >= 1 && window <= RATE_SECS);
+    rate_update(m, rate_now());
+    if (window == 1) {
+        for (int i = 0; i < RATE_HZ; i++)
+            sum += m->ticks[i];
+        return sum;
+    } else {
+        unsigned long sec = m->tick / RATE_HZ;
+        for (unsigned i = 1; i <= window; i++)
+            sum += m->secs[(sec - i) % RATE_SECS];
+        return sum / window;
+    }
+}
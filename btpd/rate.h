@@ -0,0 +1,24 @@
+#ifndef BTPD_RATE_H
+#define BTPD_RATE_H
+
+#define RATE_HZ 10      // Samples per second.
+#define RATE_SECS 60    // The longest window, in seconds.
+
+/*
+ * Counts the bytes transferred in each tenth of the last second and in
+ * each of the last minute's seconds. The meter is brought up to date
+ * when it's used, so meters nobody touches cost nothing.
+ */
+struct rate_meter {
+    unsigned long tick;         // The tick counted in cur.
+    unsigned cur;               // Bytes in the current tick.
+    unsigned sec;               // Bytes in this second's finished ticks.
+    unsigned ticks[RATE_HZ];    // Bytes in each of the last finished ticks.
+    unsigned secs[RATE_SECS];   // Bytes in each of the last finished seconds.
+};
+
+void rate_clear(struct rate_meter *m);
+void rate_add(struct rate_meter *m, unsigned long bytes);
+unsigned long rate_get(struct rate_meter *m, unsigned window);
+
+#endif
@@ -64,6 +64,7 @@ tlib_create(const uint8_t *hash)
     char hex[SHAHEXSIZE];
     bin2hex(hash, hex, 20);
     tl->num = m_nextnum;
+    tl->bw_weight = 1;
     bcopy(hash, tl->hash, 20);
     m_nextnum++;
     m_ntlibs++;
@@ -154,6 +155,7 @@ load_info(struct tlib *tl, const char *path)
     size_t size = 1 << 14;
     char buf[size];
     const char *info;
+    long long choker;
 
     if (read_file(path, buf, &size) == NULL) {
         btpd_log(BTPD_L_ERROR, "couldn't load '%s' (%s).\n", path,
@@ -174,6 +176,14 @@ load_info(struct tlib *tl, const char *path)
     tl->tot_down = benc_dget_int(info, "total download");
     tl->content_size = benc_dget_int(info, "content size");
     tl->content_have = benc_dget_int(info, "content have");
+    tl->bw_limit_in = benc_dget_int(info, "down limit");
+    tl->bw_limit_out = benc_dget_int(info, "up limit");
+    if ((tl->bw_weight = benc_dget_int(info, "weight")) == 0)
+        tl->bw_weight = 1;
+    choker = benc_dget_int(info, "seed choker");
+    if (choker < IPC_CHOKER_DEFAULT || choker > IPC_CHOKER_ROUNDROBIN)
+        choker = IPC_CHOKER_DEFAULT;
+    tl->seed_choker = choker;
     if (tl->name == NULL || tl->dir == NULL)
         btpd_err("Out of memory.\n");
 }
@@ -188,14 +198,16 @@ save_info(struct tlib *tl)
     iobuf_print(&iob,
         "d4:infod"
         "12:content havei%llde12:content sizei%llde"
-        "3:dir%d:%s4:name%d:%s"
-        "5:label%d:%s"
+        "3:dir%d:%s10:down limiti%ue"
+        "5:label%d:%s4:name%d:%s11:seed chokeri%ue"
         "14:total downloadi%llde12:total uploadi%llde"
+        "8:up limiti%ue6:weighti%ue"
         "ee",
         (long long)tl->content_have, (long long)tl->content_size,
-        (int)strlen(tl->dir), tl->dir, (int)strlen(tl->name), tl->name,
-        (int)strlen(tl->label), tl->label,
-        tl->tot_down, tl->tot_up);
+        (int)strlen(tl->dir), tl->dir, tl->bw_limit_in,
+        (int)strlen(tl->label), tl->label, (int)strlen(tl->name), tl->name,
+        tl->seed_choker, tl->tot_down, tl->tot_up, tl->bw_limit_out,
+        tl->bw_weight);
     if (iob.error)
         btpd_err("Out of memory.\n");
 
@@ -231,6 +243,32 @@ tlib_update_info(struct tlib *tl, int only_file)
     save_info(tl);
 }
 
+static void
+save_settings(struct tlib *tl)
+{
+    if (tl->tp != NULL)
+        tlib_update_info(tl, 1);
+    else
+        save_info(tl);
+}
+
+void
+tlib_set_rate(struct tlib *tl, unsigned up, unsigned down, unsigned weight)
+{
+    tl->bw_limit_out = up;
+    tl->bw_limit_in = down;
+    if (weight > 0)
+        tl->bw_weight = weight;
+    save_settings(tl);
+}
+
+void
+tlib_set_choker(struct tlib *tl, enum ipc_choker choker)
+{
+    tl->seed_choker = choker;
+    save_settings(tl);
+}
+
 static void
 write_torrent(const char *mi, size_t mi_size, const char *path)
 {
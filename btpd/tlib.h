@@ -11,6 +11,11 @@ struct tlib {
     char *label;
 
     unsigned long long tot_up, tot_down;
+    // Rate limits in bytes per second, zero for none.
+    unsigned bw_limit_in, bw_limit_out;
+    // Share of the global bandwidth relative to other torrents.
+    unsigned bw_weight;
+    enum ipc_choker seed_choker;
     off_t content_size, content_have;
 
     HTBL_ENTRY(nchain);
@@ -35,6 +40,9 @@ int tlib_del(struct tlib *tl);
 void tlib_kill(struct tlib *tl);
 
 void tlib_update_info(struct tlib *tl, int only_file);
+void tlib_set_rate(struct tlib *tl, unsigned up, unsigned down,
+    unsigned weight);
+void tlib_set_choker(struct tlib *tl, enum ipc_choker choker);
 
 struct tlib *tlib_by_hash(const uint8_t *hash);
 struct tlib *tlib_by_num(unsigned num);
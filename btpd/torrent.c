@@ -203,6 +203,7 @@ torrent_on_tick(struct torrent *tp)
         }
         break;
     case T_LEECH:
+        cm_on_tick(tp);
         if (cm_full(tp)) {
             struct peer *p, *next;
             tp->state = T_SEED;
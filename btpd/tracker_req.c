@@ -1,17 +1,18 @@
 #include "btpd.h"
 #include "http_client.h"
 
-#define REQ_DELAY 1
+#define ANN_RATE 20     // Announces sent per second to a tracker host,
+#define ANN_BURST 100   // at most this many at once after a pause, and
+#define ANN_ACTIVE 16   // at most this many waiting for their responses.
 #define DEFAULT_INTERVAL rand_between(25 * 60, 30 * 60)
 #define RETRY1_TIMEOUT (& (struct timespec) {240 + rand_between(0, 120), 0})
 #define RETRY2_TIMEOUT (& (struct timespec) {900 + rand_between(0, 300), 0})
 
 long tr_key;
 
-static long m_tlast_req, m_tnext_req;
-
 struct tr_entry {
     BTPDQ_ENTRY(tr_entry) entry;
+    struct tr_host *host;
     char *failure;
     char *url;
     enum tr_type type;
@@ -25,7 +26,9 @@ struct tr_tier {
     struct tr_entry_tq trackers;
     struct timeout timer;
     BTPDQ_ENTRY(tr_tier) entry;
+    BTPDQ_ENTRY(tr_tier) qentry;
     void *req;
+    int queued;
     int interval;
     int bad_conns;
     int active;
@@ -39,6 +42,28 @@ struct trackers {
     struct tr_tier_tq trackers;
 };
 
+/*
+ * The announces to a tracker host are metered by a token bucket and the
+ * number in flight is limited. Many torrents starting at once then get
+ * their announces out as fast as the tracker answers them, without
+ * flooding it.
+ */
+struct tr_host {
+    BTPDQ_ENTRY(tr_host) entry;
+    char *name;
+    uint16_t port;
+    unsigned refs;
+    unsigned nactive;
+    unsigned tokens;
+    long t_refill;
+    struct tr_tier_tq queue;
+    struct timeout timer;
+};
+
+BTPDQ_HEAD(tr_host_tq, tr_host);
+
+static struct tr_host_tq m_hosts = BTPDQ_HEAD_INITIALIZER(m_hosts);
+
 static struct tr_entry *
 first_nonfailed(struct tr_tier *t)
 {
@@ -59,6 +84,43 @@ all_failed(struct tr_tier *t)
     return 1;
 }
 
+static void host_timer_cb(int fd, short type, void *arg);
+
+static struct tr_host *
+host_get(const char *name, uint16_t port)
+{
+    struct tr_host *h;
+    BTPDQ_FOREACH(h, &m_hosts, entry)
+        if (h->port == port && strcmp(h->name, name) == 0)
+            break;
+    if (h == NULL) {
+        h = btpd_calloc(1, sizeof(*h));
+        if ((h->name = strdup(name)) == NULL)
+            btpd_err("Out of memory.\n");
+        h->port = port;
+        h->tokens = ANN_BURST;
+        h->t_refill = btpd_seconds;
+        BTPDQ_INIT(&h->queue);
+        evtimer_init(&h->timer, host_timer_cb, h);
+        BTPDQ_INSERT_TAIL(&m_hosts, h, entry);
+    }
+    h->refs++;
+    return h;
+}
+
+static void
+host_put(struct tr_host *h)
+{
+    assert(h->refs > 0);
+    if (--h->refs > 0)
+        return;
+    assert(h->nactive == 0 && BTPDQ_EMPTY(&h->queue));
+    btpd_timer_del(&h->timer);
+    BTPDQ_REMOVE(&m_hosts, h, entry);
+    free(h->name);
+    free(h);
+}
+
 static void *
 req_send(struct tr_tier *t)
 {
@@ -72,9 +134,60 @@ req_send(struct tr_tier *t)
     }
 }
 
+/*
+ * Send as many of the announces queued on the host as its limits allow.
+ */
+static void
+host_run(struct tr_host *h)
+{
+    struct tr_tier *t;
+    if (btpd_seconds > h->t_refill) {
+        long add = ANN_RATE * (btpd_seconds - h->t_refill);
+        h->tokens = min(ANN_BURST, h->tokens + min(ANN_BURST, add));
+        h->t_refill = btpd_seconds;
+    }
+    while ((t = BTPDQ_FIRST(&h->queue)) != NULL
+            && h->nactive < ANN_ACTIVE && h->tokens > 0) {
+        BTPDQ_REMOVE(&h->queue, t, qentry);
+        t->queued = 0;
+        h->tokens--;
+        h->nactive++;
+        if ((t->req = req_send(t)) == NULL)
+            btpd_err("failed to create tracker message to '%s' (%s).",
+                t->cur->url, strerror(errno));
+    }
+    // Slots are freed by responses, tokens come with time.
+    if (!BTPDQ_EMPTY(&h->queue) && h->tokens == 0)
+        btpd_timer_add(&h->timer, (& (struct timespec) { 1, 0 }));
+}
+
+static void
+host_timer_cb(int fd, short type, void *arg)
+{
+    host_run(arg);
+}
+
+static void
+host_done(struct tr_host *h)
+{
+    assert(h->nactive > 0);
+    h->nactive--;
+    host_run(h);
+}
+
+/*
+ * Cancel the tier's announce, whether it has been sent or is queued.
+ */
 static void
 req_cancel(struct tr_tier *t)
 {
+    if (t->queued) {
+        BTPDQ_REMOVE(&t->cur->host->queue, t, qentry);
+        t->queued = 0;
+        return;
+    }
+    if (t->req == NULL)
+        return;
     switch (t->cur->type) {
     case TR_HTTP:
         httptr_cancel(t->req);
@@ -83,26 +196,19 @@ req_cancel(struct tr_tier *t)
         abort();
     }
     t->req = NULL;
+    host_done(t->cur->host);
 }
 
 static void
 entry_send(struct tr_tier *t, struct tr_entry *e, enum tr_event event)
 {
-    if (t->req != NULL)
-        req_cancel(t);
+    req_cancel(t);
+    btpd_timer_del(&t->timer);
     t->event = event;
     t->cur = e;
-    if (m_tlast_req > btpd_seconds - REQ_DELAY) {
-        m_tnext_req = max(m_tnext_req, m_tlast_req) + REQ_DELAY;
-        btpd_timer_add(&t->timer,
-            (& (struct timespec) { m_tnext_req - btpd_seconds, 0 }));
-        return;
-    }
-    btpd_timer_del(&t->timer);
-    if ((t->req = req_send(t)) == NULL)
-        btpd_err("failed to create tracker message to '%s' (%s).",
-            e->url, strerror(errno));
-    m_tlast_req = btpd_seconds;
+    BTPDQ_INSERT_TAIL(&e->host->queue, t, qentry);
+    t->queued = 1;
+    host_run(e->host);
 }
 
 static int
@@ -143,8 +249,7 @@ tier_stop(struct tr_tier *t)
 
     if (!t->has_responded && t->bad_conns > 1) {
         btpd_timer_del(&t->timer);
-        if (t->req != NULL)
-            req_cancel(t);
+        req_cancel(t);
         t->active = 0;
     } else
         entry_send(t, first_nonfailed(t), TR_EV_STOPPED);
@@ -163,11 +268,12 @@ add_tracker(struct tr_tier *t, const char *url)
     struct tr_entry *e;
     struct http_url *hu;
     if ((hu = http_url_parse(url)) != NULL) {
-        http_url_free(hu);
         e = btpd_calloc(1, sizeof(*e));
         if ((e->url = strdup(url)) == NULL)
             btpd_err("Out of memory.\n");
         e->type = TR_HTTP;
+        e->host = host_get(hu->host, hu->port);
+        http_url_free(hu);
     } else {
         btpd_log(BTPD_L_TR, "skipping unsupported tracker '%s' for '%s'.\n",
             url, torrent_name(t->tp));
@@ -200,11 +306,11 @@ tier_kill(struct tr_tier *t)
 {
     struct tr_entry *e, *next;
     btpd_timer_del(&t->timer);
-    if (t->req != NULL)
-        req_cancel(t);
+    req_cancel(t);
     BTPDQ_FOREACH_MUTABLE(e, &t->trackers, entry , next) {
         if (e->failure != NULL)
             free(e->failure);
+        host_put(e->host);
         free(e->url);
         free(e);
     }
@@ -287,6 +393,7 @@ tr_result(struct tr_tier *t, struct tr_response *res)
 {
     struct tr_entry *e;
     t->req = NULL;
+    host_done(t->cur->host);
     switch (res->type) {
     case TR_RES_FAIL:
         t->cur->failure = benc_str(res->mi_failure, NULL, NULL);
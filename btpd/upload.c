@@ -1,175 +1,391 @@
 #include "btpd.h"
 
 #define CHOKE_INTERVAL (& (struct timespec) { 10, 0 })
+#define CHOKE_DELAY (& (struct timespec) { 0, 100000000 })
+#define CHOKE_WINDOW 20     // Seconds of transfer rates to compare peers by.
 
 static struct timeout m_choke_timer;
-static unsigned m_npeers;
-static struct peer_tq m_peerq = BTPDQ_HEAD_INITIALIZER(m_peerq);
+static struct timeout m_choke_soon;
+static int m_choke_pending;
 static int m_max_uploads;
+static unsigned m_rounds;           // Periodic choke rounds so far.
+static unsigned m_opt_turn;         // Picks the optimistic unchoke's torrent.
+static struct peer *m_optimist;     // The optimistically unchoked peer.
 
 struct peer_sort {
     struct peer *p;
-    unsigned i;
+    unsigned long rank;
 };
 
-static int
-rate_cmp(const void *arg1, const void *arg2)
-{
-    struct peer *p1 = ((struct peer_sort *)arg1)->p;
-    struct peer *p2 = ((struct peer_sort *)arg2)->p;
-    unsigned long rate1 = cm_full(p1->n->tp) ? p1->rate_up / 2: p1->rate_dwn;
-    unsigned long rate2 = cm_full(p2->n->tp) ? p2->rate_up / 2: p2->rate_dwn;
-    if (rate1 < rate2)
-        return -1;
-    else if (rate1 == rate2)
-        return 0;
+// The best ranked peers found so far in a choke round, lowest first.
+static struct peer_sort *m_top;
+
+static void
+top_swap(int i, int j)
+{
+    struct peer_sort tmp = m_top[i];
+    m_top[i] = m_top[j];
+    m_top[j] = tmp;
+}
+
+static void
+top_sift_up(int i)
+{
+    while (i > 0 && m_top[i].rank < m_top[(i - 1) / 2].rank) {
+        top_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+top_sift_down(int i, int n)
+{
+    for (;;) {
+        int min = i, c = 2 * i + 1;
+        if (c < n && m_top[c].rank < m_top[min].rank)
+            min = c;
+        if (c + 1 < n && m_top[c + 1].rank < m_top[min].rank)
+            min = c + 1;
+        if (min == i)
+            break;
+        top_swap(i, min);
+        i = min;
+    }
+}
+
+static enum ipc_choker
+choke_seed_mode(struct torrent *tp)
+{
+    return tp->tl->seed_choker != IPC_CHOKER_DEFAULT ?
+        tp->tl->seed_choker : net_seed_choker;
+}
+
+/*
+ * Returns how fast we send to the peer if we seed its torrent, otherwise
+ * how fast it sends to us.
+ */
+static unsigned long
+choke_rate(struct peer *p)
+{
+    if (cm_full(p->n->tp))
+        return rate_get(&p->rate_up, CHOKE_WINDOW);
+    else if (peer_active_down(p))
+        return rate_get(&p->rate_dwn, CHOKE_WINDOW);
     else
-        return 1;
+        return 0;
+}
+
+/*
+ * Returns the rank of a peer among its torrent's, higher is better. The
+ * peers are ranked by their rate, except in a torrent we seed with the
+ * round robin choker. There they are ranked by how little we have sent
+ * them, and an unchoked peer keeps its rank until it has been sent a
+ * piece's worth of data so that it isn't choked again right away.
+ */
+static unsigned long
+choke_rank(struct peer *p)
+{
+    struct torrent *tp = p->n->tp;
+    if (!cm_full(tp) || choke_seed_mode(tp) == IPC_CHOKER_FASTEST)
+        return choke_rate(p);
+    else {
+        unsigned long long sent = p->uploaded;
+        if ((p->mp->flags & PF_I_CHOKE) == 0
+                && sent - p->ul_unchoked_at < tp->piece_length)
+            sent = p->ul_unchoked_at;
+        return ULONG_MAX - min(sent, ULONG_MAX);
+    }
+}
+
+static void
+choke_unchoke(struct peer *p)
+{
+    p->ul_unchoked_at = p->uploaded;
+    peer_unchoke(p);
+}
+
+/*
+ * Returns whether the peer could use an upload slot.
+ */
+static int
+choke_candidate(struct peer *p)
+{
+    return (p->mp->flags & PF_P_WANT) != 0 && !peer_full(p);
+}
+
+/*
+ * Count the peers of each torrent that want an upload slot. The torrent
+ * order used to break ties between torrents rotates every round.
+ */
+static void
+choke_count(void)
+{
+    struct torrent *tp;
+    struct peer *p;
+    unsigned ntorrents = 0, i = 0;
+
+    BTPDQ_FOREACH(tp, torrent_get_all(), entry)
+        ntorrents++;
+    BTPDQ_FOREACH(tp, torrent_get_all(), entry) {
+        struct net *n = tp->net;
+        n->ul_ndemand = 0;
+        n->ul_nchoked = 0;
+        n->ul_nslots = 0;
+        n->ul_order = (i++ + m_rounds) % ntorrents;
+        if (!n->active)
+            continue;
+        BTPDQ_FOREACH(p, &n->peers, p_entry) {
+            if (choke_candidate(p)) {
+                n->ul_ndemand++;
+                if (p->mp->flags & PF_I_CHOKE)
+                    n->ul_nchoked++;
+            }
+        }
+    }
+}
+
+/*
+ * Give the optimistic unchoke to a random choked peer of the next
+ * torrent in turn that has any, so that every torrent gets its turn no
+ * matter how many peers it has.
+ */
+static void
+choke_pick_optimist(void)
+{
+    struct torrent *tp;
+    struct net *n = NULL;
+    struct peer *p;
+    unsigned nnets = 0, turn, found = 0;
+
+    m_optimist = NULL;
+    BTPDQ_FOREACH(tp, torrent_get_all(), entry)
+        if (tp->net->ul_nchoked > 0)
+            nnets++;
+    if (nnets == 0)
+        return;
+    turn = m_opt_turn++ % nnets;
+    BTPDQ_FOREACH(tp, torrent_get_all(), entry) {
+        if (tp->net->ul_nchoked > 0 && turn-- == 0) {
+            n = tp->net;
+            break;
+        }
+    }
+    BTPDQ_FOREACH(p, &n->peers, p_entry)
+        if (choke_candidate(p) && (p->mp->flags & PF_I_CHOKE) != 0)
+            if (random() % ++found == 0)
+                m_optimist = p;
+}
+
+/*
+ * Returns whether torrent a should get the next upload slot before
+ * torrent b. Slots go to the torrent with the fewest for its weight.
+ */
+static int
+choke_before(struct net *a, struct net *b)
+{
+    unsigned long long sa =
+        (unsigned long long)a->ul_nslots * b->tp->tl->bw_weight;
+    unsigned long long sb =
+        (unsigned long long)b->ul_nslots * a->tp->tl->bw_weight;
+    return sa < sb || (sa == sb && a->ul_order < b->ul_order);
+}
+
+/*
+ * Hand out the slots one at a time, each to the torrent that has the
+ * least for its weight among those wanting more.
+ */
+static void
+choke_alloc_slots(int nslots)
+{
+    for (; nslots > 0; nslots--) {
+        struct torrent *tp;
+        struct net *best = NULL;
+        BTPDQ_FOREACH(tp, torrent_get_all(), entry) {
+            struct net *n = tp->net;
+            if (n->ul_nslots < n->ul_ndemand
+                    && (best == NULL || choke_before(n, best)))
+                best = n;
+        }
+        if (best == NULL)
+            break;
+        best->ul_nslots++;
+    }
+}
+
+/*
+ * Mark the torrent's best ranked peers, as many as it got slots, to be
+ * unchoked. Peers that aren't interested but are as fast as those are
+ * unchoked too, without taking a slot.
+ */
+static void
+choke_choose(struct net *n)
+{
+    int ntop = 0, nslots = n->ul_nslots;
+    unsigned long minrate;
+    struct peer *p;
+
+    if (m_optimist != NULL && m_optimist->n == n)
+        nslots--;
+    // The first peers seen win ties, so start at a place that moves every
+    // round to let peers of equal rank take turns.
+    p = BTPDQ_FIRST(&n->peers);
+    for (unsigned i = (m_rounds * max(nslots, 1)) % n->npeers; i > 0; i--)
+        p = BTPDQ_NEXT(p, p_entry);
+    for (unsigned i = 0; i < n->npeers; i++) {
+        unsigned long rank;
+        if (p != m_optimist && choke_candidate(p)) {
+            rank = choke_rank(p);
+            if (ntop < nslots) {
+                m_top[ntop].p = p;
+                m_top[ntop].rank = rank;
+                top_sift_up(ntop);
+                ntop++;
+            } else if (ntop > 0 && rank > m_top[0].rank) {
+                m_top[0].p = p;
+                m_top[0].rank = rank;
+                top_sift_down(0, ntop);
+            }
+        }
+        if ((p = BTPDQ_NEXT(p, p_entry)) == NULL)
+            p = BTPDQ_FIRST(&n->peers);
+    }
+
+    minrate = ntop < nslots ? 1 : ULONG_MAX;
+    for (int i = 0; i < ntop; i++) {
+        m_top[i].p->mp->flags |= PF_UL_CHOSEN;
+        if (ntop == nslots)
+            minrate = min(minrate, max(choke_rate(m_top[i].p), 1));
+    }
+    BTPDQ_FOREACH(p, &n->peers, p_entry)
+        if ((p->mp->flags & PF_P_WANT) == 0 && !peer_full(p)
+                && choke_rate(p) >= minrate)
+            p->mp->flags |= PF_UL_CHOSEN;
 }
 
 static void
 choke_do(void)
 {
+    struct torrent *tp;
+    struct peer *p;
+
     if (m_max_uploads < 0) {
-        struct peer *p;
-        BTPDQ_FOREACH(p, &m_peerq, ul_entry)
-            if (p->mp->flags & PF_I_CHOKE)
-                peer_unchoke(p);
+        BTPDQ_FOREACH(tp, torrent_get_all(), entry)
+            BTPDQ_FOREACH(p, &tp->net->peers, p_entry)
+                if (p->mp->flags & PF_I_CHOKE)
+                    choke_unchoke(p);
     } else if (m_max_uploads == 0) {
-        struct peer *p;
-        BTPDQ_FOREACH(p, &m_peerq, ul_entry)
-            if ((p->mp->flags & PF_I_CHOKE) == 0)
-                peer_choke(p);
+        BTPDQ_FOREACH(tp, torrent_get_all(), entry)
+            BTPDQ_FOREACH(p, &tp->net->peers, p_entry)
+                if ((p->mp->flags & PF_I_CHOKE) == 0)
+                    peer_choke(p);
     } else {
-        struct peer_sort worthy[m_npeers];
-        int nworthy = 0;
-        int i = 0;
-        int found = 0;
-        struct peer *p;
-        int unchoked[m_npeers];
-
-        BTPDQ_FOREACH(p, &m_peerq, ul_entry) {
-            int ok = 0;
-            if (!peer_full(p)) {
-                if (cm_full(p->n->tp)) {
-                    if (p->rate_up > 0)
-                        ok = 1;
-                } else if (peer_active_down(p) && p->rate_dwn > 0)
-                    ok = 1;
-            }
-            if (ok) {
-                worthy[nworthy].p = p;
-                worthy[nworthy].i = i;
-                nworthy++;
-            }
-            i++;
-        }
-        qsort(worthy, nworthy, sizeof(worthy[0]), rate_cmp);
-
-        bzero(unchoked, sizeof(unchoked));
-        for (i = nworthy - 1; i >= 0 && found < m_max_uploads - 1; i--) {
-            if ((worthy[i].p->mp->flags & PF_P_WANT) != 0)
-                found++;
-            if ((worthy[i].p->mp->flags & PF_I_CHOKE) != 0)
-                peer_unchoke(worthy[i].p);
-            unchoked[worthy[i].i] = 1;
-        }
+        choke_count();
+        if (m_optimist != NULL && !choke_candidate(m_optimist))
+            m_optimist = NULL;
+        if (m_optimist == NULL)
+            choke_pick_optimist();
+        // The optimistic unchoke counts as one of its torrent's slots.
+        if (m_optimist != NULL)
+            m_optimist->n->ul_nslots++;
+        choke_alloc_slots(m_max_uploads - 1);
+        BTPDQ_FOREACH(tp, torrent_get_all(), entry)
+            if (tp->net->active && tp->net->npeers > 0)
+                choke_choose(tp->net);
 
-        i = 0;
-        BTPDQ_FOREACH(p, &m_peerq, ul_entry) {
-            if (!unchoked[i]) {
-                if (found < m_max_uploads && !peer_full(p)) {
-                    if (p->mp->flags & PF_P_WANT)
-                        found++;
+        BTPDQ_FOREACH(tp, torrent_get_all(), entry) {
+            BTPDQ_FOREACH(p, &tp->net->peers, p_entry) {
+                if (p == m_optimist || (p->mp->flags & PF_UL_CHOSEN) != 0) {
+                    p->mp->flags &= ~PF_UL_CHOSEN;
                     if (p->mp->flags & PF_I_CHOKE)
-                        peer_unchoke(p);
-                } else {
-                    if ((p->mp->flags & PF_I_CHOKE) == 0)
-                        peer_choke(p);
-                }
+                        choke_unchoke(p);
+                } else if ((p->mp->flags & PF_I_CHOKE) == 0)
+                    peer_choke(p);
             }
-            i++;
         }
     }
 }
 
+/*
+ * Peers come and go and change their minds often. Their changes are
+ * collected and handled in one choke round a little later.
+ */
 static void
-shuffle_optimists(void)
+choke_later(void)
 {
-    for (int i = 0; i < m_npeers; i++) {
-        struct peer *p = BTPDQ_FIRST(&m_peerq);
-        if ((p->mp->flags & (PF_P_WANT|PF_I_CHOKE)) == (PF_P_WANT|PF_I_CHOKE)) {
-            break;
-        } else {
-            BTPDQ_REMOVE(&m_peerq, p, ul_entry);
-            BTPDQ_INSERT_TAIL(&m_peerq, p, ul_entry);
-        }
+    if (!m_choke_pending) {
+        m_choke_pending = 1;
+        btpd_timer_add(&m_choke_soon, CHOKE_DELAY);
     }
 }
 
+static void
+choke_soon_cb(int sd, short type, void *arg)
+{
+    m_choke_pending = 0;
+    choke_do();
+}
+
 static void
 choke_cb(int sd, short type, void *arg)
 {
     btpd_timer_add(&m_choke_timer, CHOKE_INTERVAL);
-    static int cb_count = 0;
-    cb_count++;
-    if (cb_count % 3 == 0)
-        shuffle_optimists();
+    m_rounds++;
+    if (m_rounds % 3 == 0)
+        m_optimist = NULL;
+    if (m_choke_pending) {
+        btpd_timer_del(&m_choke_soon);
+        m_choke_pending = 0;
+    }
     choke_do();
 }
 
 void
 ul_on_new_peer(struct peer *p)
 {
-    long where = rand_between(-2, m_npeers);
-    if (where < 1)
-        BTPDQ_INSERT_HEAD(&m_peerq, p, ul_entry);
-    else {
-        struct peer *it = BTPDQ_FIRST(&m_peerq);
-        where--;
-        while (where > 0) {
-            it = BTPDQ_NEXT(it, ul_entry);
-            where--;
-        }
-        BTPDQ_INSERT_AFTER(&m_peerq, it, p, ul_entry);
-    }
-    m_npeers++;
-    choke_do();
 }
 
 void
 ul_on_lost_peer(struct peer *p)
 {
-    assert(m_npeers > 0);
-    BTPDQ_REMOVE(&m_peerq, p, ul_entry);
-    m_npeers--;
+    if (p == m_optimist)
+        m_optimist = NULL;
     if ((p->mp->flags & (PF_P_WANT|PF_I_CHOKE)) == PF_P_WANT)
-        choke_do();
+        choke_later();
 }
 
 void
 ul_on_lost_torrent(struct net *n)
 {
-    struct peer *p;
-    BTPDQ_FOREACH(p, &n->peers, p_entry) {
-        BTPDQ_REMOVE(&m_peerq, p, ul_entry);
-        m_npeers--;
-    }
-    choke_do();
+    if (m_optimist != NULL && m_optimist->n == n)
+        m_optimist = NULL;
+    choke_later();
 }
 
 void
 ul_on_interest(struct peer *p)
 {
-    if ((p->mp->flags & PF_I_CHOKE) == 0)
-        choke_do();
+    choke_later();
 }
 
 void
 ul_on_uninterest(struct peer *p)
 {
     if ((p->mp->flags & PF_I_CHOKE) == 0)
-        choke_do();
+        choke_later();
+}
+
+/*
+ * A peer of a round robin seed gives way to the others as soon as it has
+ * been sent its piece's worth of data, not at the next periodic round.
+ */
+void
+ul_on_upload(struct peer *p, unsigned long bytes)
+{
+    struct torrent *tp = p->n->tp;
+    unsigned long long sent = p->uploaded - p->ul_unchoked_at;
+    if (sent >= tp->piece_length && sent - bytes < tp->piece_length
+            && cm_full(tp) && choke_seed_mode(tp) == IPC_CHOKER_ROUNDROBIN)
+        choke_later();
 }
 
 void
@@ -189,6 +405,10 @@ ul_set_max_uploads(void)
         else
             m_max_uploads = 5 + (net_bw_limit_out / (100 << 10));
     }
+
+    free(m_top);
+    m_top = m_max_uploads > 1 ?
+        btpd_calloc(m_max_uploads - 1, sizeof(*m_top)) : NULL;
 }
 
 void
@@ -198,4 +418,5 @@ ul_init(void)
 
     evtimer_init(&m_choke_timer, choke_cb, NULL);
     btpd_timer_add(&m_choke_timer, CHOKE_INTERVAL);
+    evtimer_init(&m_choke_soon, choke_soon_cb, NULL);
 }
@@ -0,0 +1,81 @@
+#include "btpd.h"
+
+#include <pthread.h>
+
+struct wk_job {
+    BTPDQ_ENTRY(wk_job) entry;
+    void (*work)(void *);
+    void (*done)(void *);
+    void *arg;
+};
+
+BTPDQ_HEAD(wk_job_tq, wk_job);
+
+static struct wk_job_tq m_jobq = BTPDQ_HEAD_INITIALIZER(m_jobq);
+static pthread_mutex_t m_jobq_lock;
+static pthread_cond_t m_jobq_cond;
+
+/*
+ * Run work(arg) on one of the worker threads. When it has finished
+ * done(arg) is called from the event loop thread, so the done callback
+ * may safely touch any btpd state. The work function must not.
+ */
+void
+btpd_work(void (*work)(void *), void (*done)(void *), void *arg)
+{
+    struct wk_job *job = btpd_calloc(1, sizeof(*job));
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+
+    pthread_mutex_lock(&m_jobq_lock);
+    BTPDQ_INSERT_TAIL(&m_jobq, job, entry);
+    pthread_mutex_unlock(&m_jobq_lock);
+    pthread_cond_signal(&m_jobq_cond);
+}
+
+static void
+wk_td_cb(void *arg)
+{
+    struct wk_job *job = arg;
+    job->done(job->arg);
+    free(job);
+}
+
+static void *
+wk_td(void *arg)
+{
+    struct wk_job *job;
+    while (1) {
+        pthread_mutex_lock(&m_jobq_lock);
+        while (BTPDQ_EMPTY(&m_jobq))
+            pthread_cond_wait(&m_jobq_cond, &m_jobq_lock);
+        job = BTPDQ_FIRST(&m_jobq);
+        BTPDQ_REMOVE(&m_jobq, job, entry);
+        pthread_mutex_unlock(&m_jobq_lock);
+
+        job->work(job->arg);
+
+        td_post_begin();
+        td_post(wk_td_cb, job);
+        td_post_end();
+    }
+    pthread_exit(NULL);
+}
+
+static void
+errdie(int err, const char *str)
+{
+    if (err != 0)
+        btpd_err("worker_init: %s (%s).\n", str, strerror(err));
+}
+
+void
+worker_init(void)
+{
+    pthread_t td;
+    errdie(pthread_mutex_init(&m_jobq_lock, NULL), "pthread_mutex_init");
+    errdie(pthread_cond_init(&m_jobq_cond, NULL), "pthread_cond_init");
+    for (int i = 0; i < wk_nthreads; i++)
+        errdie(pthread_create(&td, NULL, wk_td, NULL), "pthread_create");
+}
@@ -112,6 +112,7 @@ static struct {
     void (*help)(void);
 } cmd_table[] = {
     { "add", cmd_add, usage_add },
+    { "choker", cmd_choker, usage_choker },
     { "del", cmd_del, usage_del },
     { "kill", cmd_kill, usage_kill },
     { "list", cmd_list, usage_list },
@@ -138,6 +139,7 @@ usage(void)
         "\n"
         "Commands:\n"
         "add\t- Add torrents to btpd.\n"
+        "choker\t- Set how seeded torrents choose peers to upload to.\n"
         "del\t- Remove torrents from btpd.\n"
         "kill\t- Shut down btpd.\n"
         "list\t- List torrents.\n"
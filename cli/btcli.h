@@ -37,6 +37,8 @@ void print_percent(long long part, long long whole);
 
 void usage_add(void);
 void cmd_add(int argc, char **argv);
+void usage_choker(void);
+void cmd_choker(int argc, char **argv);
 void usage_del(void);
 void cmd_del(int argc, char **argv);
 void usage_list(void);
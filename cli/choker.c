@@ -0,0 +1,57 @@
+#include "btcli.h"
+
+void
+usage_choker(void)
+{
+    printf(
+        "Set how seeded torrents choose the peers to upload to.\n"
+        "\n"
+        "Usage: choker <mode> torrent ...\n"
+        "\n"
+        "Arguments:\n"
+        "<mode>\n"
+        "\tfastest - Upload to the peers we upload the fastest to.\n"
+        "\tround-robin - Upload to the peers we have sent the least.\n"
+        "\tdefault - Use the choker given to btpd by --seed-choker.\n"
+        "\n"
+        "torrent ...\n"
+        "\tThe torrents to set the choker of.\n"
+        "\n"
+        );
+    exit(1);
+}
+
+static struct option choker_opts [] = {
+    { "help", no_argument, NULL, 'H' },
+    {NULL, 0, NULL, 0}
+};
+
+void
+cmd_choker(int argc, char **argv)
+{
+    int ch;
+    enum ipc_choker choker;
+    struct ipc_torrent t;
+
+    while ((ch = getopt_long(argc, argv, "", choker_opts, NULL)) != -1)
+        usage_choker();
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2)
+        usage_choker();
+
+    if (strcmp(argv[0], "fastest") == 0)
+        choker = IPC_CHOKER_FASTEST;
+    else if (strcmp(argv[0], "round-robin") == 0)
+        choker = IPC_CHOKER_ROUNDROBIN;
+    else if (strcmp(argv[0], "default") == 0)
+        choker = IPC_CHOKER_DEFAULT;
+    else
+        usage_choker();
+
+    btpd_connect();
+    for (int i = 1; i < argc; i++)
+        if (torrent_spec(argv[i], &t))
+            handle_ipc_res(btpd_choker(ipc, &t, choker), "choker", argv[i]);
+}
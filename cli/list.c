@@ -32,6 +32,8 @@ struct item {
     char hash[SHAHEXSIZE];
     char st;
     long long cgot, csize, totup, downloaded, uploaded, rate_up, rate_down;
+    long long uplimit;
+    enum ipc_choker choker;
     uint32_t torrent_pieces, pieces_have, pieces_seen;
     BTPDQ_ENTRY(item) entry;
 };
@@ -92,6 +94,8 @@ list_cb(int obji, enum ipc_err objerr, struct ipc_get_res *res, void *arg)
     itm->uploaded       = res[IPC_TVAL_SESSUP].v.num;
     itm->rate_up        = res[IPC_TVAL_RATEUP].v.num;
     itm->rate_down      = res[IPC_TVAL_RATEDWN].v.num;
+    itm->uplimit        = res[IPC_TVAL_UPLIMIT].v.num;
+    itm->choker         = res[IPC_TVAL_CHOKER].v.num;
     itm->torrent_pieces = (uint32_t)res[IPC_TVAL_PCCOUNT].v.num;
     itm->pieces_seen    = (uint32_t)res[IPC_TVAL_PCSEEN].v.num;
     itm->pieces_have    = (uint32_t)res[IPC_TVAL_PCGOT].v.num;
@@ -99,6 +103,25 @@ list_cb(int obji, enum ipc_err objerr, struct ipc_get_res *res, void *arg)
     itm_insert(itms, itm);
 }
 
+static const char *
+choker_name(enum ipc_choker choker)
+{
+    return choker == IPC_CHOKER_ROUNDROBIN ? "round-robin" : "fastest";
+}
+
+/*
+ * Print how much of its upload limit the torrent uses, or a dash if it
+ * has no limit.
+ */
+static void
+print_utilization(struct item *p)
+{
+    if (p->uplimit > 0)
+        print_percent(p->rate_up, p->uplimit);
+    else
+        printf("%6s ", "-");
+}
+
 void
 print_items(struct items* itms, char *format)
 {
@@ -116,9 +139,12 @@ print_items(struct items* itms, char *format)
                             case '^': printf("%lld", p->rate_up);        break;
 
                             case 'A': printf("%u",   p->pieces_seen);    break;
+                            case 'C': printf("%s",   choker_name(p->choker)); break;
                             case 'D': printf("%lld", p->downloaded);     break;
                             case 'H': printf("%u",   p->pieces_have);    break;
+                            case 'L': printf("%lld", p->uplimit);        break;
                             case 'P': printf("%u",   p->peers);          break;
+                            case 'R': print_utilization(p);              break;
                             case 'S': printf("%lld", p->csize);          break;
                             case 'U': printf("%lld", p->uploaded);       break;
                             case 'T': printf("%u",   p->torrent_pieces); break;
@@ -176,7 +202,7 @@ cmd_list(int argc, char **argv)
            IPC_TVAL_TOTUP,   IPC_TVAL_CSIZE,  IPC_TVAL_CGOT,    IPC_TVAL_PCOUNT,
            IPC_TVAL_PCCOUNT, IPC_TVAL_PCSEEN, IPC_TVAL_PCGOT,   IPC_TVAL_SESSUP,
            IPC_TVAL_SESSDWN, IPC_TVAL_RATEUP, IPC_TVAL_RATEDWN, IPC_TVAL_IHASH,
-           IPC_TVAL_DIR, IPC_TVAL_LABEL };
+           IPC_TVAL_DIR, IPC_TVAL_LABEL, IPC_TVAL_UPLIMIT, IPC_TVAL_CHOKER };
     size_t nkeys = ARRAY_COUNT(keys);
     struct items itms;
     while ((ch = getopt_long(argc, argv, "aif:", list_opts, NULL)) != -1) {
@@ -7,10 +7,19 @@ usage_rate(void)
         "Set upload and download rate.\n"
         "\n"
         "Usage: rate <up> <down>\n"
+        "       rate [-w weight] <up> <down> torrent ...\n"
         "\n"
         "Arguments:\n"
         "<up> <down>\n"
-        "\tThe up/down rate in KB/s\n"
+        "\tThe up/down rate in KB/s. Zero means no limit.\n"
+        "\n"
+        "torrent ...\n"
+        "\tSet the rate limits of these torrents instead of the global ones.\n"
+        "\n"
+        "Options:\n"
+        "-w weight\n"
+        "\tThe torrents' share of the global rates and upload slots\n"
+        "\trelative to other torrents. The default weight is 1.\n"
         "\n"
         );
     exit(1);
@@ -61,20 +70,38 @@ void
 cmd_rate(int argc, char **argv)
 {
     int ch;
-    unsigned up, down;
+    unsigned up, down, weight = 0;
+    struct ipc_torrent t;
+    char *end;
 
-    while ((ch = getopt_long(argc, argv, "", start_opts, NULL)) != -1)
-        usage_rate();
+    while ((ch = getopt_long(argc, argv, "w:", start_opts, NULL)) != -1) {
+        switch (ch) {
+        case 'w':
+            weight = strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || weight == 0)
+                usage_rate();
+            break;
+        default:
+            usage_rate();
+        }
+    }
     argc -= optind;
     argv += optind;
 
-    if (argc < 2)
+    if (argc < 2 || (weight > 0 && argc < 3))
         usage_rate();
 
     up = parse_rate(argv[0]);
     down = parse_rate(argv[1]);
 
     btpd_connect();
-    handle_ipc_res(btpd_rate(ipc, up, down), "rate", argv[1]);
+    if (argc == 2)
+        handle_ipc_res(btpd_rate(ipc, up, down), "rate", argv[1]);
+    else {
+        for (int i = 2; i < argc; i++)
+            if (torrent_spec(argv[i], &t))
+                handle_ipc_res(btpd_trate(ipc, &t, up, down, weight), "rate",
+                    argv[i]);
+    }
 }
 
@@ -1,24 +1,105 @@
 #include <sys/epoll.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "evloop.h"
 
+#define EPOLL_INIT_SIZE 64
+
 static int m_epfd;
 
-static struct epoll_event m_evs[100];
-static uint8_t m_valid[100];
+static struct epoll_event *m_evs;
+static uint8_t *m_valid;
+static int m_cap;
+
+/*
+ * Interest changes aren't passed to the kernel right away. The changed
+ * fdevs are put on a list which is applied just before epoll_wait. An
+ * fdev that is disabled and enabled again before that costs nothing.
+ */
+static struct fdev *m_dirty;
+
+static int
+epoll_grow(void)
+{
+    int ncap = m_cap * 2;
+    struct epoll_event *nm_evs = realloc(m_evs, ncap * sizeof(*m_evs));
+    uint8_t *nm_valid = realloc(m_valid, ncap * sizeof(*m_valid));
+    if (nm_evs != NULL)
+        m_evs = nm_evs;
+    if (nm_valid != NULL)
+        m_valid = nm_valid;
+    if (nm_evs == NULL || nm_valid == NULL)
+        return errno;
+    m_cap = ncap;
+    return 0;
+}
 
 int
 evloop_init(void)
 {
     if (timeheap_init() != 0)
         return -1;
+    m_cap = EPOLL_INIT_SIZE;
+    if ((m_evs = calloc(m_cap, sizeof(*m_evs))) == NULL)
+        return -1;
+    if ((m_valid = calloc(m_cap, sizeof(*m_valid))) == NULL) {
+        free(m_evs);
+        return -1;
+    }
     m_epfd = epoll_create(getdtablesize());
     return m_epfd >= 0 ? 0 : -1;
 }
 
+static int
+fdev_apply(struct fdev *ev)
+{
+    struct epoll_event epev;
+    int err = 0;
+    if (ev->flags == ev->kflags)
+        return 0;
+    epev.data.ptr = ev;
+    epev.events =
+        ((ev->flags & EV_READ) ? EPOLLIN : 0) |
+        ((ev->flags & EV_WRITE) ? EPOLLOUT : 0);
+    if (ev->kflags == 0)
+        err = epoll_ctl(m_epfd, EPOLL_CTL_ADD, ev->fd, &epev);
+    else if (ev->flags == 0)
+        err = epoll_ctl(m_epfd, EPOLL_CTL_DEL, ev->fd, &epev);
+    else
+        err = epoll_ctl(m_epfd, EPOLL_CTL_MOD, ev->fd, &epev);
+    ev->kflags = ev->flags;
+    return err;
+}
+
+static void
+fdev_dirty(struct fdev *ev)
+{
+    if (ev->dprev == NULL) {
+        if ((ev->dnext = m_dirty) != NULL)
+            m_dirty->dprev = &ev->dnext;
+        m_dirty = ev;
+        ev->dprev = &m_dirty;
+    }
+}
+
+static int
+apply_dirty(void)
+{
+    int err = 0;
+    struct fdev *ev;
+    while ((ev = m_dirty) != NULL) {
+        if ((m_dirty = ev->dnext) != NULL)
+            m_dirty->dprev = &m_dirty;
+        ev->dprev = NULL;
+        if (fdev_apply(ev) != 0)
+            err = -1;
+    }
+    return err;
+}
+
 int
 fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
 {
@@ -26,6 +107,8 @@ fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
     ev->cb = cb;
     ev->arg = arg;
     ev->flags = 0;
+    ev->kflags = 0;
+    ev->dprev = NULL;
     ev->index = -1;
     return fdev_enable(ev, flags);
 }
@@ -33,41 +116,21 @@ fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
 int
 fdev_enable(struct fdev *ev, uint16_t flags)
 {
-    struct epoll_event epev;
-    int err = 0;
     uint16_t sf = ev->flags;
     ev->flags |= flags;
-    if (sf != ev->flags) {
-        epev.data.ptr = ev;
-        epev.events =
-            ((ev->flags & EV_READ) ? EPOLLIN : 0) |
-            ((ev->flags & EV_WRITE) ? EPOLLOUT : 0);
-        if (sf == 0)
-            err = epoll_ctl(m_epfd, EPOLL_CTL_ADD, ev->fd, &epev);
-        else
-            err = epoll_ctl(m_epfd, EPOLL_CTL_MOD, ev->fd, &epev);
-    }
-    return err;
+    if (sf != ev->flags)
+        fdev_dirty(ev);
+    return 0;
 }
 
 int
 fdev_disable(struct fdev *ev, uint16_t flags)
 {
-    struct epoll_event epev;
-    int err = 0;
     uint16_t sf = ev->flags;
     ev->flags &= ~flags;
-    if (sf != ev->flags) {
-        epev.data.ptr = ev;
-        epev.events =
-            ((ev->flags & EV_READ) ? EPOLLIN : 0) |
-            ((ev->flags & EV_WRITE) ? EPOLLOUT : 0);
-        if (ev->flags == 0)
-            err = epoll_ctl(m_epfd, EPOLL_CTL_DEL, ev->fd, &epev);
-        else
-            err = epoll_ctl(m_epfd, EPOLL_CTL_MOD, ev->fd, &epev);
-    }
-    return err;
+    if (sf != ev->flags)
+        fdev_dirty(ev);
+    return 0;
 }
 
 int
@@ -75,7 +138,15 @@ fdev_del(struct fdev *ev)
 {
     if (ev->index >= 0)
         m_valid[ev->index] = 0;
-    return fdev_disable(ev, EV_READ|EV_WRITE);
+    if (ev->dprev != NULL) {
+        if (ev->dnext != NULL)
+            ev->dnext->dprev = ev->dprev;
+        *ev->dprev = ev->dnext;
+        ev->dprev = NULL;
+    }
+    // The fd is usually closed right after this, so remove it now.
+    ev->flags = 0;
+    return fdev_apply(ev);
 }
 
 int
@@ -91,7 +162,9 @@ evloop(void)
         else
             millisecs = -1;
 
-        if ((nev = epoll_wait(m_epfd, m_evs, 100, millisecs)) < 0) {
+        if (apply_dirty() != 0)
+            return -1;
+        if ((nev = epoll_wait(m_epfd, m_evs, m_cap, millisecs)) < 0) {
             if (errno == EINTR)
                 continue;
             else
@@ -114,5 +187,8 @@ evloop(void)
             if (m_valid[i])
                 ev->index = -1;
         }
+        // A full event array may mean that more events were ready.
+        if (nev == m_cap)
+            epoll_grow();
     }
 }
@@ -20,7 +20,10 @@ struct fdev {
     int fd;
     uint16_t flags;
 #ifdef EVLOOP_EPOLL
-    int16_t index;
+    uint16_t kflags;
+    int index;
+    struct fdev *dnext;
+    struct fdev **dprev;    /* Non NULL while on the dirty list */
 #else
     int16_t rdidx;
     int16_t wridx;
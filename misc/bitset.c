@@ -0,0 +1,106 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "bitset.h"
+
+/*
+ * The first bit of a field is the most significant bit of its first
+ * byte, as in the BitTorrent protocol. Eight bytes read as a big endian
+ * word therefore keep the bits in index order, and the fields can be
+ * worked on 64 bits at a time.
+ */
+
+enum bs_op { BS_ONE, BS_NOT, BS_ANDNOT };
+
+static inline uint64_t
+bs_word(const uint8_t *bits, unsigned long nbytes, unsigned long byte)
+{
+    uint64_t w = 0;
+    if (byte + 8 <= nbytes) {
+        for (int i = 0; i < 8; i++)
+            w = w << 8 | bits[byte + i];
+    } else {
+        for (unsigned long i = byte; i < byte + 8; i++)
+            w = w << 8 | (i < nbytes ? bits[i] : 0);
+    }
+    return w;
+}
+
+static inline unsigned long
+bs_next(enum bs_op op, const uint8_t *a, const uint8_t *b,
+    unsigned long nbits, unsigned long from)
+{
+    unsigned long nbytes = (nbits + 7) / 8;
+    while (from < nbits) {
+        unsigned long byte = from / 8;
+        uint64_t w = bs_word(a, nbytes, byte);
+        switch (op) {
+        case BS_ONE:
+            break;
+        case BS_NOT:
+            w = ~w;
+            break;
+        case BS_ANDNOT:
+            w &= ~bs_word(b, nbytes, byte);
+            break;
+        }
+        w &= ~(uint64_t)0 >> from % 8;
+        if (w != 0) {
+            unsigned long i = byte * 8 + __builtin_clzll(w);
+            return i < nbits ? i : nbits;
+        }
+        from = (byte + 8) * 8;
+    }
+    return nbits;
+}
+
+unsigned long
+bitset_count(const uint8_t *bits, unsigned long nbits)
+{
+    unsigned long nbytes = nbits / 8, count = 0, byte;
+    for (byte = 0; byte + 8 <= nbytes; byte += 8)
+        count += __builtin_popcountll(bs_word(bits, nbytes, byte));
+    for (; byte < nbytes; byte++)
+        count += __builtin_popcount(bits[byte]);
+    if (nbits % 8 != 0)
+        count += __builtin_popcount(bits[nbytes] & (0xff00 >> nbits % 8));
+    return count;
+}
+
+unsigned long
+bitset_next(const uint8_t *bits, unsigned long nbits, unsigned long from)
+{
+    return bs_next(BS_ONE, bits, NULL, nbits, from);
+}
+
+unsigned long
+bitset_next_clear(const uint8_t *bits, unsigned long nbits,
+    unsigned long from)
+{
+    return bs_next(BS_NOT, bits, NULL, nbits, from);
+}
+
+unsigned long
+bitset_next_andnot(const uint8_t *a, const uint8_t *b, unsigned long nbits,
+    unsigned long from)
+{
+    return bs_next(BS_ANDNOT, a, b, nbits, from);
+}
+
+void
+bitset_clear_range(uint8_t *bits, unsigned long from, unsigned long to)
+{
+    if (from >= to)
+        return;
+    unsigned long first = from / 8, last = (to - 1) / 8;
+    uint8_t fmask = 0xff >> from % 8;
+    uint8_t lmask = 0xff << (7 - (to - 1) % 8);
+    if (first == last) {
+        bits[first] &= ~(fmask & lmask);
+        return;
+    }
+    bits[first] &= ~fmask;
+    if (last > first + 1)
+        memset(bits + first + 1, 0, last - first - 1);
+    bits[last] &= ~lmask;
+}
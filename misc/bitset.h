@@ -0,0 +1,20 @@
+#ifndef BTPD_BITSET_H
+#define BTPD_BITSET_H
+
+/*
+ * Operations on whole bit fields, as used by set_bit and has_bit.
+ * The functions returning an index return nbits if there's no such bit.
+ */
+
+unsigned long bitset_count(const uint8_t *bits, unsigned long nbits);
+
+unsigned long bitset_next(const uint8_t *bits, unsigned long nbits,
+    unsigned long from);
+unsigned long bitset_next_clear(const uint8_t *bits, unsigned long nbits,
+    unsigned long from);
+unsigned long bitset_next_andnot(const uint8_t *a, const uint8_t *b,
+    unsigned long nbits, unsigned long from);
+
+void bitset_clear_range(uint8_t *bits, unsigned long from, unsigned long to);
+
+#endif
@@ -306,6 +306,33 @@ btpd_rate(struct ipc *ipc, unsigned up, unsigned down)
     return ipc_buf_req_code(ipc, &iob);
 }
 
+enum ipc_err
+btpd_trate(struct ipc *ipc, struct ipc_torrent *tp, unsigned up,
+    unsigned down, unsigned weight)
+{
+    struct iobuf iob = iobuf_init(64);
+    if (tp->by_hash) {
+        iobuf_swrite(&iob, "l5:trate20:");
+        iobuf_write(&iob, tp->u.hash, 20);
+    } else
+        iobuf_print(&iob, "l5:tratei%ue", tp->u.num);
+    iobuf_print(&iob, "i%uei%uei%uee", up, down, weight);
+    return ipc_buf_req_code(ipc, &iob);
+}
+
+enum ipc_err
+btpd_choker(struct ipc *ipc, struct ipc_torrent *tp, enum ipc_choker choker)
+{
+    struct iobuf iob = iobuf_init(64);
+    if (tp->by_hash) {
+        iobuf_swrite(&iob, "l6:choker20:");
+        iobuf_write(&iob, tp->u.hash, 20);
+    } else
+        iobuf_print(&iob, "l6:chokeri%ue", tp->u.num);
+    iobuf_print(&iob, "i%uee", choker);
+    return ipc_buf_req_code(ipc, &iob);
+}
+
 enum ipc_err
 btpd_start(struct ipc *ipc, struct ipc_torrent *tp)
 {
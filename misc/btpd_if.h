@@ -41,6 +41,12 @@ enum ipc_tstate {
     IPC_TSTATE_SEED
 };
 
+enum ipc_choker {
+    IPC_CHOKER_DEFAULT,
+    IPC_CHOKER_FASTEST,
+    IPC_CHOKER_ROUNDROBIN
+};
+
 #ifndef DAEMON
 
 struct ipc;
@@ -78,6 +84,10 @@ enum ipc_err btpd_add(struct ipc *ipc, const char *mi, size_t mi_size,
     const char *content, const char *name, const char *label);
 enum ipc_err btpd_del(struct ipc *ipc, struct ipc_torrent *tp);
 enum ipc_err btpd_rate(struct ipc *ipc, unsigned up, unsigned down);
+enum ipc_err btpd_trate(struct ipc *ipc, struct ipc_torrent *tp, unsigned up,
+    unsigned down, unsigned weight);
+enum ipc_err btpd_choker(struct ipc *ipc, struct ipc_torrent *tp,
+    enum ipc_choker choker);
 enum ipc_err btpd_start(struct ipc *ipc, struct ipc_torrent *tp);
 enum ipc_err btpd_start_all(struct ipc *ipc);
 enum ipc_err btpd_stop(struct ipc *ipc, struct ipc_torrent *tp);
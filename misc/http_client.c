@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include "iobuf.h"
+#include "queue.h"
 #include "subr.h"
 #include "http_client.h"
 
@@ -81,18 +82,37 @@ http_url_free(struct http_url *url)
 
 struct http_req {
     enum {
-        PS_HEAD, PS_CHUNK_SIZE, PS_CHUNK_DATA, PS_CHUNK_CRLF, PS_ID_DATA
+        PS_HEAD, PS_CHUNK_SIZE, PS_CHUNK_DATA, PS_CHUNK_CRLF, PS_TRAILER,
+        PS_ID_DATA
     } pstate;
 
-    int parsing;
     int cancel;
     int chunked;
+    int keepalive;
     long length;
 
     http_cb_t cb;
     void *arg;
 
     struct http_url *url;
+    struct iobuf wbuf;
+
+    struct http_conn *conn;
+    BTPDQ_ENTRY(http_req) entry;
+};
+
+BTPDQ_HEAD(http_req_tq, http_req);
+
+/*
+ * A connection to an HTTP server. Requests are written to it as soon as
+ * they're added and the responses are parsed in the same order. The
+ * connection is dead once the server has closed it or sent something
+ * that can't be parsed.
+ */
+struct http_conn {
+    struct http_req_tq reqs;
+    unsigned nreqs;
+    int dead;
     struct iobuf rbuf;
     struct iobuf wbuf;
 };
@@ -102,19 +122,24 @@ http_free(struct http_req *req)
 {
     if (req->url != NULL)
         http_url_free(req->url);
-    iobuf_free(&req->rbuf);
     iobuf_free(&req->wbuf);
     free(req);
 }
 
 static void
-http_error(struct http_req *req)
+http_callback(struct http_req *req, struct http_response *res)
+{
+    if (!req->cancel)
+        req->cb(req, res, req->arg);
+}
+
+static void
+http_error(struct http_req *req, int error)
 {
     struct http_response res;
     res.type = HTTP_T_ERR;
-    res.v.error = 1;
-    req->cb(req, &res, req->arg);
-    http_free(req);
+    res.v.error = error;
+    http_callback(req, &res);
 }
 
 static char *
@@ -143,11 +168,13 @@ headers_parse(struct http_req *req, char *buf, char *end)
 
     if (sscanf(buf, "HTTP/%d.%d %d", &majv, &minv, &code) != 3)
         return 0;
+    req->keepalive = majv > 1 || (majv == 1 && minv >= 1);
+    // These responses never have a body.
+    if (code == 204 || code == 304)
+        req->length = 0;
     res.type = HTTP_T_CODE;
     res.v.code = code;
-    req->cb(req, &res, req->arg);
-    if (req->cancel)
-        return 1;
+    http_callback(req, &res);
 
     cur = strchr(buf, '\n') + 1;
     nl = strnl(cur, &nlsize);
@@ -187,9 +214,7 @@ headers_parse(struct http_req *req, char *buf, char *end)
         res.type = HTTP_T_HEADER;
         res.v.header.n = name;
         res.v.header.v = value;
-        req->cb(req, &res, req->arg);
-        if (req->cancel)
-            return 1;
+        http_callback(req, &res);
         if ((!req->chunked
                 && strcasecmp("Transfer-Encoding", name) == 0
                 && strcasecmp("chunked", value) == 0))
@@ -201,139 +226,202 @@ headers_parse(struct http_req *req, char *buf, char *end)
             if (errno)
                 req->length = -1;
         }
+        if (strcasecmp("Connection", name) == 0) {
+            if (strcasecmp("close", value) == 0)
+                req->keepalive = 0;
+            else if (strcasecmp("keep-alive", value) == 0)
+                req->keepalive = 1;
+        }
     }
     if (req->chunked)
         req->pstate = PS_CHUNK_SIZE;
-    else
+    else {
         req->pstate = PS_ID_DATA;
+        // Without a length the body ends when the server closes.
+        if (req->length < 0)
+            req->keepalive = 0;
+    }
     return 1;
 }
 
+/*
+ * Fail the requests left on a dead connection. The one whose response
+ * had begun to arrive got a bad response, the others may be tried again
+ * on another connection.
+ */
+static void
+conn_fail(struct http_conn *conn)
+{
+    struct http_req *req;
+    int started = conn->rbuf.off > 0;
+    conn->dead = 1;
+    while ((req = BTPDQ_FIRST(&conn->reqs)) != NULL) {
+        BTPDQ_REMOVE(&conn->reqs, req, entry);
+        conn->nreqs--;
+        if (started || req->pstate != PS_HEAD)
+            http_error(req, HTTP_E_BAD);
+        else
+            http_error(req, HTTP_E_CLOSED);
+        http_free(req);
+        started = 0;
+    }
+}
+
+/*
+ * Parse the responses in the read buffer, len is the number of bytes
+ * just read or zero if the server has closed the connection. Returns
+ * zero if the connection died.
+ */
 static int
-http_parse(struct http_req *req, int len)
+conn_parse(struct http_conn *conn, int len)
 {
     char *end, *numend;
     size_t dlen, consumed;
     struct http_response res;
+    struct http_req *req;
 again:
+    if ((req = BTPDQ_FIRST(&conn->reqs)) == NULL) {
+        if (len == 0 || conn->rbuf.off > 0)
+            goto error;
+        return 1;
+    }
     switch (req->pstate) {
     case PS_HEAD:
         if (len == 0)
             goto error;
-        if ((end = iobuf_find(&req->rbuf, "\r\n\r\n", 4)) != NULL)
+        if ((end = iobuf_find(&conn->rbuf, "\r\n\r\n", 4)) != NULL)
             dlen = 4;
-        else if ((end = iobuf_find(&req->rbuf, "\n\n", 2)) != NULL)
+        else if ((end = iobuf_find(&conn->rbuf, "\n\n", 2)) != NULL)
             dlen = 2;
         else {
-            if (req->rbuf.off < (1 << 15))
+            if (conn->rbuf.off < (1 << 15))
                 return 1;
             else
                 goto error;
         }
 
-        /* req->rbuf.buf may be reallocated inside iobuf_write()
+        /* conn->rbuf.buf may be reallocated inside iobuf_write()
          * so calculate the offset before that is called */
-        consumed = end - (char *)req->rbuf.buf + dlen;
+        consumed = end - (char *)conn->rbuf.buf + dlen;
 
-        if (!iobuf_write(&req->rbuf, "", 1))
+        if (!iobuf_write(&conn->rbuf, "", 1))
             goto error;
-        req->rbuf.off--;
-        if (!headers_parse(req, req->rbuf.buf, end))
+        conn->rbuf.off--;
+        if (!headers_parse(req, conn->rbuf.buf, end))
             goto error;
-        if (req->cancel)
-            goto cancel;
-        iobuf_consumed(&req->rbuf, consumed);
+        iobuf_consumed(&conn->rbuf, consumed);
+        if (req->length == 0 && !req->chunked)
+            goto done;
         goto again;
     case PS_CHUNK_SIZE:
         assert(req->chunked);
-        if (len == 0)
-            goto error;
-        if ((end = iobuf_find(&req->rbuf, "\n", 1)) == NULL) {
-            if (req->rbuf.off < 20)
+        if ((end = iobuf_find(&conn->rbuf, "\n", 1)) == NULL) {
+            if (len == 0)
+                goto error;
+            if (conn->rbuf.off < 20)
                 return 1;
             else
                 goto error;
         }
         errno = 0;
-        req->length = strtol(req->rbuf.buf, &numend, 16);
-        if (req->length < 0 || numend == (char *)req->rbuf.buf || errno)
+        req->length = strtol(conn->rbuf.buf, &numend, 16);
+        if (req->length < 0 || numend == (char *)conn->rbuf.buf || errno)
             goto error;
-        if (req->length == 0)
-            goto done;
-        iobuf_consumed(&req->rbuf, end - (char *)req->rbuf.buf + 1);
-        req->pstate = PS_CHUNK_DATA;
+        iobuf_consumed(&conn->rbuf, end - (char *)conn->rbuf.buf + 1);
+        req->pstate = req->length == 0 ? PS_TRAILER : PS_CHUNK_DATA;
         goto again;
     case PS_CHUNK_DATA:
-        if (len == 0)
-            goto error;
         assert(req->length > 0);
-        dlen = min(req->rbuf.off, req->length);
+        dlen = min(conn->rbuf.off, req->length);
         if (dlen > 0) {
             res.type = HTTP_T_DATA;
             res.v.data.l = dlen;
-            res.v.data.p = req->rbuf.buf;
-            req->cb(req, &res, req->arg);
-            if (req->cancel)
-                goto cancel;
-            iobuf_consumed(&req->rbuf, dlen);
+            res.v.data.p = conn->rbuf.buf;
+            http_callback(req, &res);
+            iobuf_consumed(&conn->rbuf, dlen);
             req->length -= dlen;
             if (req->length == 0) {
                 req->pstate = PS_CHUNK_CRLF;
                 goto again;
             }
         }
-        return 1;
-    case PS_CHUNK_CRLF:
         if (len == 0)
             goto error;
+        return 1;
+    case PS_CHUNK_CRLF:
         assert(req->length == 0);
-        if (req->rbuf.off < 2)
+        if (conn->rbuf.off < 2) {
+            if (len == 0)
+                goto error;
             return 1;
-        if (req->rbuf.buf[0] == '\r' && req->rbuf.buf[1] == '\n')
+        }
+        if (conn->rbuf.buf[0] == '\r' && conn->rbuf.buf[1] == '\n')
             dlen = 2;
-        else if (req->rbuf.buf[0] == '\n')
+        else if (conn->rbuf.buf[0] == '\n')
             dlen = 1;
         else
             goto error;
-        iobuf_consumed(&req->rbuf, dlen);
+        iobuf_consumed(&conn->rbuf, dlen);
         req->pstate = PS_CHUNK_SIZE;
         goto again;
+    case PS_TRAILER:
+        // Skip the trailer. An empty line ends it and the response.
+        if ((end = iobuf_find(&conn->rbuf, "\n", 1)) == NULL) {
+            if (len == 0)
+                goto error;
+            if (conn->rbuf.off < (1 << 15))
+                return 1;
+            else
+                goto error;
+        }
+        dlen = end - (char *)conn->rbuf.buf + 1;
+        iobuf_consumed(&conn->rbuf, dlen);
+        if (dlen <= 2)
+            goto done;
+        goto again;
     case PS_ID_DATA:
         if (len == 0 && req->length < 0)
             goto done;
-        else if (len == 0)
-            goto error;
         if (req->length < 0)
-            dlen = req->rbuf.off;
+            dlen = conn->rbuf.off;
         else
-            dlen = min(req->rbuf.off, req->length);
+            dlen = min(conn->rbuf.off, req->length);
         if (dlen > 0) {
             res.type = HTTP_T_DATA;
-            res.v.data.p = req->rbuf.buf;
+            res.v.data.p = conn->rbuf.buf;
             res.v.data.l = dlen;
-            req->cb(req, &res, req->arg);
-            if (req->cancel)
-                goto cancel;
-            iobuf_consumed(&req->rbuf, dlen);
+            http_callback(req, &res);
+            iobuf_consumed(&conn->rbuf, dlen);
             if (req->length > 0) {
                 req->length -= dlen;
                 if (req->length == 0)
                     goto done;
             }
         }
+        if (len == 0)
+            goto error;
         return 1;
     default:
         abort();
     }
 error:
-    http_error(req);
+    conn_fail(conn);
     return 0;
 done:
+    BTPDQ_REMOVE(&conn->reqs, req, entry);
+    conn->nreqs--;
+    if (!req->keepalive)
+        conn->dead = 1;
     res.type = HTTP_T_DONE;
-    req->cb(req, &res, req->arg);
-cancel:
+    http_callback(req, &res);
     http_free(req);
-    return 0;
+    if (conn->dead) {
+        conn_fail(conn);
+        return 0;
+    }
+    if (conn->rbuf.off > 0 || len == 0)
+        goto again;
+    return 1;
 }
 
 struct http_url *
@@ -342,59 +430,6 @@ http_url_get(struct http_req *req)
     return req->url;
 }
 
-int
-http_want_read(struct http_req *req)
-{
-    return 1;
-}
-
-int
-http_want_write(struct http_req *req)
-{
-    return req->wbuf.off > 0;
-}
-
-int
-http_read(struct http_req *req, int sd)
-{
-    if (!iobuf_accommodate(&req->rbuf, 4096)) {
-        http_error(req);
-        return 0;
-    }
-    ssize_t nr = read(sd, req->rbuf.buf + req->rbuf.off, 4096);
-    if (nr < 0 && errno == EAGAIN)
-        return 1;
-    else if (nr < 0) {
-        http_error(req);
-        return 0;
-    } else {
-        req->rbuf.off += nr;
-        req->parsing = 1;
-        if (http_parse(req, nr)) {
-            req->parsing = 0;
-            return 1;
-        } else
-            return 0;
-    }
-}
-
-int
-http_write(struct http_req *req, int sd)
-{
-    assert(req->wbuf.off > 0);
-    ssize_t nw =
-        write(sd, req->wbuf.buf, req->wbuf.off);
-    if (nw < 0 && errno == EAGAIN)
-        return 1;
-    else if (nw < 0) {
-        http_error(req);
-        return 0;
-    } else {
-        iobuf_consumed(&req->wbuf, nw);
-        return 1;
-    }
-}
-
 int
 http_get(struct http_req **out, const char *url, const char *hdrs,
     http_cb_t cb, void *arg)
@@ -407,12 +442,11 @@ http_get(struct http_req **out, const char *url, const char *hdrs,
     req->url = http_url_parse(url);
     if (req->url == NULL)
         goto error;
-    req->rbuf = iobuf_init(4096);
     req->wbuf = iobuf_init(1024);
     if (!iobuf_print(&req->wbuf, "GET %s HTTP/1.1\r\n"
             "Host: %s:%hu\r\n"
             "Accept-Encoding:\r\n"
-            "Connection: close\r\n"
+            "Connection: keep-alive\r\n"
             "%s"
             "\r\n", req->url->uri, req->url->host, req->url->port, hdrs))
         goto error;
@@ -424,11 +458,130 @@ error:
     return 0;
 }
 
+/*
+ * A request that has been added to a connection stays there until its
+ * response has been read, but its callback won't be called again.
+ */
 void
 http_cancel(struct http_req *req)
 {
-    if (req->parsing)
+    if (req->conn != NULL)
         req->cancel = 1;
     else
         http_free(req);
 }
+
+struct http_conn *
+http_conn_new(void)
+{
+    struct http_conn *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL)
+        return NULL;
+    BTPDQ_INIT(&conn->reqs);
+    conn->rbuf = iobuf_init(4096);
+    conn->wbuf = iobuf_init(1024);
+    if (conn->rbuf.error || conn->wbuf.error) {
+        iobuf_free(&conn->rbuf);
+        iobuf_free(&conn->wbuf);
+        free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+/*
+ * Free the connection. The requests still on it fail with HTTP_E_CONN.
+ */
+void
+http_conn_free(struct http_conn *conn)
+{
+    struct http_req *req;
+    conn->dead = 1;
+    while ((req = BTPDQ_FIRST(&conn->reqs)) != NULL) {
+        BTPDQ_REMOVE(&conn->reqs, req, entry);
+        http_error(req, HTTP_E_CONN);
+        http_free(req);
+    }
+    iobuf_free(&conn->rbuf);
+    iobuf_free(&conn->wbuf);
+    free(conn);
+}
+
+/*
+ * Queue the request on the connection, behind the ones already sent on
+ * it. Returns zero if the connection is dead or out of memory.
+ */
+int
+http_conn_add(struct http_conn *conn, struct http_req *req)
+{
+    assert(req->conn == NULL);
+    if (conn->dead || !iobuf_write(&conn->wbuf, req->wbuf.buf, req->wbuf.off))
+        return 0;
+    iobuf_free(&req->wbuf);
+    req->conn = conn;
+    BTPDQ_INSERT_TAIL(&conn->reqs, req, entry);
+    conn->nreqs++;
+    return 1;
+}
+
+int
+http_conn_alive(struct http_conn *conn)
+{
+    return !conn->dead;
+}
+
+unsigned
+http_conn_nreqs(struct http_conn *conn)
+{
+    return conn->nreqs;
+}
+
+int
+http_conn_want_write(struct http_conn *conn)
+{
+    return conn->wbuf.off > 0;
+}
+
+/*
+ * Read from the connection's socket and deliver what can be parsed.
+ * Returns zero when the connection is dead and should be closed.
+ */
+int
+http_conn_read(struct http_conn *conn, int sd)
+{
+    if (conn->dead)
+        return 0;
+    if (!iobuf_accommodate(&conn->rbuf, 4096)) {
+        conn_fail(conn);
+        return 0;
+    }
+    ssize_t nr = read(sd, conn->rbuf.buf + conn->rbuf.off, 4096);
+    if (nr < 0 && errno == EAGAIN)
+        return 1;
+    else if (nr < 0) {
+        conn_fail(conn);
+        return 0;
+    } else {
+        conn->rbuf.off += nr;
+        return conn_parse(conn, nr);
+    }
+}
+
+int
+http_conn_write(struct http_conn *conn, int sd)
+{
+    if (conn->dead)
+        return 0;
+    if (conn->wbuf.off == 0)
+        return 1;
+    ssize_t nw = write(sd, conn->wbuf.buf, conn->wbuf.off);
+    if (nw < 0 && errno == EAGAIN)
+        return 1;
+    else if (nw < 0) {
+        conn_fail(conn);
+        return 0;
+    } else {
+        iobuf_consumed(&conn->wbuf, nw);
+        return 1;
+    }
+}
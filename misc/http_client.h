@@ -10,6 +10,12 @@ struct http_url {
 struct http_url *http_url_parse(const char *url);
 void http_url_free(struct http_url *url);
 
+enum {
+    HTTP_E_BAD = 1, // Bad or truncated response, or out of memory.
+    HTTP_E_CONN,    // The connection failed or timed out.
+    HTTP_E_CLOSED   // Closed by the server before the response began.
+};
+
 struct http_response {
     enum {
         HTTP_T_ERR, HTTP_T_CODE, HTTP_T_HEADER, HTTP_T_DATA, HTTP_T_DONE
@@ -29,15 +35,21 @@ struct http_response {
 };
 
 struct http_req;
+struct http_conn;
 typedef void (*http_cb_t)(struct http_req *, struct http_response *, void *);
 
 int http_get(struct http_req **out, const char *url, const char *hdrs,
     http_cb_t cb, void *arg);
 void http_cancel(struct http_req *req);
 struct http_url *http_url_get(struct http_req *req);
-int http_want_read(struct http_req *req);
-int http_want_write(struct http_req *req);
-int http_read(struct http_req *req, int sd);
-int http_write(struct http_req *req, int sd);
+
+struct http_conn *http_conn_new(void);
+void http_conn_free(struct http_conn *conn);
+int http_conn_add(struct http_conn *conn, struct http_req *req);
+int http_conn_alive(struct http_conn *conn);
+unsigned http_conn_nreqs(struct http_conn *conn);
+int http_conn_want_write(struct http_conn *conn);
+int http_conn_read(struct http_conn *conn, int sd);
+int http_conn_write(struct http_conn *conn, int sd);
 
 #endif
@@ -43,6 +43,8 @@ TVDEF(TOTUP,    NUM,            "total_up")
 TVDEF(TRERR,    NUM,            "tr_errors")
 TVDEF(TRGOOD,   NUM,            "tr_good")
 TVDEF(LABEL,    STR,            "label")
+TVDEF(CHOKER,   NUM,            "seed_choker")
+TVDEF(UPLIMIT,  NUM,            "up_limit")
 #ifdef __IPCTV
 #undef __IPCTV
 #undef TVDEF
@@ -2,15 +2,100 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include <openssl/sha.h>
 
 #include "metainfo.h"
+#include "queue.h"
 #include "subr.h"
 #include "stream.h"
 
+/*
+ * Every stream keeps a descriptor per file, opened on demand. Open
+ * descriptors that aren't being used are kept in a list shared by all
+ * streams, in least recently used order. When more than m_maxfds
+ * descriptors are open the least recently used ones are closed.
+ */
+struct bts_fd {
+    int fd;
+    unsigned users;
+    off_t off;
+    BTPDQ_ENTRY(bts_fd) entry;
+};
+
+BTPDQ_HEAD(bts_fd_tq, bts_fd);
+
+static struct bts_fd_tq m_lru = BTPDQ_HEAD_INITIALIZER(m_lru);
+static unsigned m_nfds;
+static unsigned m_maxfds = 64;
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+bts_set_max_fds(unsigned maxfds)
+{
+    pthread_mutex_lock(&m_lock);
+    m_maxfds = maxfds;
+    pthread_mutex_unlock(&m_lock);
+}
+
+static void
+fd_shrink(void)
+{
+    struct bts_fd *f;
+    while (m_nfds > m_maxfds && (f = BTPDQ_FIRST(&m_lru)) != NULL) {
+        BTPDQ_REMOVE(&m_lru, f, entry);
+        close(f->fd);
+        f->fd = -1;
+        m_nfds--;
+    }
+}
+
+static int
+fd_acquire(struct bt_stream *bts, unsigned i, int *fd)
+{
+    int err, nfd;
+    struct bts_fd *f = &bts->fds[i];
+
+    pthread_mutex_lock(&m_lock);
+    if (f->fd == -1) {
+        pthread_mutex_unlock(&m_lock);
+        if ((err = bts->fd_cb(bts->files[i].path, &nfd, bts->fd_arg)) != 0)
+            return err;
+        pthread_mutex_lock(&m_lock);
+        if (f->fd == -1) {
+            f->fd = nfd;
+            m_nfds++;
+        } else {
+            close(nfd);
+            if (f->users == 0)
+                BTPDQ_REMOVE(&m_lru, f, entry);
+        }
+    } else if (f->users == 0)
+        BTPDQ_REMOVE(&m_lru, f, entry);
+    f->users++;
+    *fd = f->fd;
+    fd_shrink();
+    pthread_mutex_unlock(&m_lock);
+    return 0;
+}
+
+static void
+fd_release(struct bt_stream *bts, unsigned i)
+{
+    struct bts_fd *f = &bts->fds[i];
+    pthread_mutex_lock(&m_lock);
+    assert(f->users > 0);
+    f->users--;
+    if (f->users == 0) {
+        BTPDQ_INSERT_TAIL(&m_lru, f, entry);
+        fd_shrink();
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
 int
 bts_open(struct bt_stream **res, unsigned nfiles, struct mi_file *files,
     fdcb_t fd_cb, void *fd_arg)
@@ -18,15 +103,21 @@ bts_open(struct bt_stream **res, unsigned nfiles, struct mi_file *files,
     struct bt_stream *bts = calloc(1, sizeof(*bts));
     if (bts == NULL)
         return ENOMEM;
+    if ((bts->fds = calloc(nfiles, sizeof(*bts->fds))) == NULL) {
+        free(bts);
+        return ENOMEM;
+    }
 
     bts->nfiles = nfiles;
     bts->files = files;
     bts->fd_cb = fd_cb;
     bts->fd_arg = fd_arg;
-    bts->fd = -1;
 
-    for (unsigned i = 0; i < bts->nfiles; i++)
+    for (unsigned i = 0; i < bts->nfiles; i++) {
+        bts->fds[i].fd = -1;
+        bts->fds[i].off = bts->totlen;
         bts->totlen += bts->files[i].length;
+    }
 
     *res = bts;
     return 0;
@@ -36,122 +127,97 @@ int
 bts_close(struct bt_stream *bts)
 {
     int err = 0;
-    if (bts->fd != -1 && close(bts->fd) == -1)
-        err = errno;
+    pthread_mutex_lock(&m_lock);
+    for (unsigned i = 0; i < bts->nfiles; i++) {
+        struct bts_fd *f = &bts->fds[i];
+        if (f->fd == -1)
+            continue;
+        assert(f->users == 0);
+        BTPDQ_REMOVE(&m_lru, f, entry);
+        if (close(f->fd) == -1 && err == 0)
+            err = errno;
+        m_nfds--;
+    }
+    pthread_mutex_unlock(&m_lock);
+    free(bts->fds);
     free(bts);
     return err;
 }
 
-int
-bts_seek(struct bt_stream *bts, off_t off)
+/*
+ * Find the file that contains the stream offset off.
+ */
+static unsigned
+bts_file_at(struct bt_stream *bts, off_t off)
 {
-    if (bts->t_off == off)
-        return 0;
-
-    bts->t_off = off;
-
-    unsigned i;
-    for (i = 0; off >= bts->files[i].length; i++)
-        off -= bts->files[i].length;
-
-    if (i != bts->index) {
-        if (bts->fd != -1) {
-            if (close(bts->fd) == -1)
-                return errno;
-            bts->fd = -1;
-        }
-    } else if (bts->fd != -1)
-        lseek(bts->fd, off, SEEK_SET);
-
-    bts->index = i;
-    bts->f_off = off;
-
-    return 0;
+    unsigned lo = 0, hi = bts->nfiles - 1;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo + 1) / 2;
+        if (bts->fds[mid].off <= off)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
 }
 
+/*
+ * The functions below that access the files store the index of the
+ * file an error occurred on in *fi. The stream itself is shared by
+ * threads and must not be used to remember it.
+ */
 int
-bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len)
+bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len,
+    unsigned *fi)
 {
     size_t boff, wantread;
     ssize_t didread;
-    int err;
+    unsigned i;
+    int err, fd;
 
     assert(off + len <= bts->totlen);
-    if ((err = bts_seek(bts, off)) != 0)
-        return err;
-
     boff = 0;
     while (boff < len) {
-        if (bts->fd == -1) {
-            while (bts->files[bts->index].length == 0)
-                bts->index++;
-            err = bts->fd_cb(bts->files[bts->index].path,
-                &bts->fd, bts->fd_arg);
-            if (err != 0)
-                return err;
-            if (bts->f_off != 0)
-                lseek(bts->fd, bts->f_off, SEEK_SET);
-        }
-
-        wantread = min(len - boff, bts->files[bts->index].length - bts->f_off);
-        didread = read(bts->fd, buf + boff, wantread);
+        *fi = i = bts_file_at(bts, off + boff);
+        if ((err = fd_acquire(bts, i, &fd)) != 0)
+            return err;
+        off_t f_off = off + boff - bts->fds[i].off;
+        wantread = min(len - boff, bts->files[i].length - f_off);
+        didread = pread(fd, buf + boff, wantread, f_off);
+        err = errno;
+        fd_release(bts, i);
         if (didread == -1)
-            return errno;
-
-        boff += didread;
-        bts->f_off += didread;
-        bts->t_off += didread;
-        if (bts->f_off == bts->files[bts->index].length) {
-            close(bts->fd);
-            bts->fd = -1;
-            bts->f_off = 0;
-            bts->index++;
-        }
+            return err;
         if (didread != wantread)
             return ENOENT;
+        boff += didread;
     }
     return 0;
 }
 
 int
-bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len)
+bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len,
+    unsigned *fi)
 {
     size_t boff, wantwrite;
     ssize_t didwrite;
-    int err;
+    unsigned i;
+    int err, fd;
 
     assert(off + len <= bts->totlen);
-    if ((err = bts_seek(bts, off)) != 0)
-        return err;
-
     boff = 0;
     while (boff < len) {
-        if (bts->fd == -1) {
-            while (bts->files[bts->index].length == 0)
-                bts->index++;
-            err = bts->fd_cb(bts->files[bts->index].path,
-                &bts->fd, bts->fd_arg);
-            if (err != 0)
-                return err;
-            if (bts->f_off != 0)
-                lseek(bts->fd, bts->f_off, SEEK_SET);
-        }
-
-        wantwrite = min(len - boff, bts->files[bts->index].length - bts->f_off);
-        didwrite = write(bts->fd, buf + boff, wantwrite);
+        *fi = i = bts_file_at(bts, off + boff);
+        if ((err = fd_acquire(bts, i, &fd)) != 0)
+            return err;
+        off_t f_off = off + boff - bts->fds[i].off;
+        wantwrite = min(len - boff, bts->files[i].length - f_off);
+        didwrite = pwrite(fd, buf + boff, wantwrite, f_off);
+        err = errno;
+        fd_release(bts, i);
         if (didwrite == -1)
-            return errno;
-
+            return err;
         boff += didwrite;
-        bts->f_off += didwrite;
-        bts->t_off += didwrite;
-        if (bts->f_off == bts->files[bts->index].length) {
-            if (close(bts->fd) == -1)
-                return errno;
-            bts->fd = -1;
-            bts->f_off = 0;
-            bts->index++;
-        }
     }
     return 0;
 }
@@ -159,7 +225,8 @@ bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len)
 #define SHAFILEBUF (1 << 15)
 
 int
-bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash)
+bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash,
+    unsigned *fi)
 {
     SHA_CTX ctx;
     char buf[SHAFILEBUF];
@@ -169,7 +236,7 @@ bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash)
     SHA1_Init(&ctx);
     while (length > 0) {
         wantread = min(length, SHAFILEBUF);
-        if ((err = bts_get(bts, start, buf, wantread)) != 0)
+        if ((err = bts_get(bts, start, buf, wantread, fi)) != 0)
             break;
         length -= wantread;
         start += wantread;
@@ -179,8 +246,111 @@ bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash)
     return err;
 }
 
+#define HASHRUNBUF (1 << 20)
+
+/*
+ * Hash the consecutive pieces starting at off, reading the data with
+ * large sequential reads. The hash of each piece is passed to cb along
+ * with the piece's position in the run.
+ */
+int
+bts_sha_run(struct bt_stream *bts, off_t off, off_t length, off_t plen,
+    hashcb_t cb, void *arg, unsigned *fi)
+{
+    SHA_CTX ctx;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    uint8_t *buf;
+    uint32_t piece = 0;
+    off_t pleft = min(plen, length);
+    size_t boff, wantread;
+    int err = 0;
+
+    if ((buf = malloc(HASHRUNBUF)) == NULL)
+        return ENOMEM;
+
+    SHA1_Init(&ctx);
+    while (length > 0) {
+        wantread = min(length, HASHRUNBUF);
+        if ((err = bts_get(bts, off, buf, wantread, fi)) != 0)
+            break;
+        length -= wantread;
+        off += wantread;
+        boff = 0;
+        while (boff < wantread) {
+            size_t n = min(wantread - boff, pleft);
+            SHA1_Update(&ctx, buf + boff, n);
+            boff += n;
+            pleft -= n;
+            if (pleft == 0) {
+                SHA1_Final(hash, &ctx);
+                cb(piece, hash, arg);
+                piece++;
+                pleft = min(plen, length + wantread - boff);
+                SHA1_Init(&ctx);
+            }
+        }
+    }
+    free(buf);
+    return err;
+}
+
+/*
+ * Tell the system that the len bytes at off will be read soon.
+ */
+int
+bts_prefetch(struct bt_stream *bts, off_t off, size_t len)
+{
+    int err, fd;
+    size_t boff = 0;
+
+    assert(off + len <= bts->totlen);
+    while (boff < len) {
+        unsigned i = bts_file_at(bts, off + boff);
+        off_t f_off = off + boff - bts->fds[i].off;
+        size_t flen = min(len - boff, bts->files[i].length - f_off);
+        if ((err = fd_acquire(bts, i, &fd)) != 0)
+            return err;
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fd, f_off, flen, POSIX_FADV_WILLNEED);
+#endif
+        fd_release(bts, i);
+        boff += flen;
+    }
+    return 0;
+}
+
+/*
+ * Returns true if the len bytes at off are in the same file.
+ */
+int
+bts_contiguous(struct bt_stream *bts, off_t off, size_t len)
+{
+    unsigned i = bts_file_at(bts, off);
+    return off + len <= bts->fds[i].off + bts->files[i].length;
+}
+
+/*
+ * Get the descriptor and file offset of the data at off. The descriptor
+ * stays open until it's given back with bts_fd_put.
+ */
+int
+bts_fd_get(struct bt_stream *bts, off_t off, int *fd, off_t *f_off,
+    unsigned *fi)
+{
+    unsigned i = bts_file_at(bts, off);
+    *fi = i;
+    *f_off = off - bts->fds[i].off;
+    return fd_acquire(bts, i, fd);
+}
+
+void
+bts_fd_put(struct bt_stream *bts, off_t off)
+{
+    fd_release(bts, bts_file_at(bts, off));
+}
+
 const char *
-bts_filename(struct bt_stream *bts)
+bts_filename(struct bt_stream *bts, unsigned fi)
 {
-    return bts->files[bts->index].path;
+    return bts->files[fi].path;
 }
@@ -4,25 +4,37 @@
 typedef int (*fdcb_t)(const char *, int *, void *);
 typedef void (*hashcb_t)(uint32_t, uint8_t *, void *);
 
+struct bts_fd;
+
 struct bt_stream {
     unsigned nfiles;
     struct mi_file *files;
     off_t totlen;
     fdcb_t fd_cb;
     void *fd_arg;
-    unsigned index;
-    off_t t_off;
-    off_t f_off;
-    int fd;
+    struct bts_fd *fds;
 };
 
+void bts_set_max_fds(unsigned maxfds);
+
 int bts_open(struct bt_stream **res, unsigned nfiles, struct mi_file *files,
     fdcb_t fd_cb, void *fd_arg);
 int bts_close(struct bt_stream *bts);
-int bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len);
-int bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len);
-int bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash);
+int bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len,
+    unsigned *fi);
+int bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len,
+    unsigned *fi);
+int bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash,
+    unsigned *fi);
+int bts_sha_run(struct bt_stream *bts, off_t off, off_t length, off_t plen,
+    hashcb_t cb, void *arg, unsigned *fi);
+
+int bts_prefetch(struct bt_stream *bts, off_t off, size_t len);
+int bts_contiguous(struct bt_stream *bts, off_t off, size_t len);
+int bts_fd_get(struct bt_stream *bts, off_t off, int *fd, off_t *f_off,
+    unsigned *fi);
+void bts_fd_put(struct bt_stream *bts, off_t off);
 
-const char *bts_filename(struct bt_stream *bts);
+const char *bts_filename(struct bt_stream *bts, unsigned fi);
 
 #endif